@@ -0,0 +1,77 @@
+/**************************************************************************/
+/*!
+ @file     NdefFile.h
+ @license  BSD
+
+ Compile time builder for the NDEF file served by MyCard.
+
+ The file is laid out exactly as the tag emulation reads it: two bytes of
+ NLEN followed by a single short MIME media record. Declare it with
+ NDEF_MIME_FILE() and hand it to MyCard::setNdefFile_P(), so the whole
+ message lives in flash and nothing is encoded or copied at startup.
+ */
+/**************************************************************************/
+
+#ifndef __NDEF_FILE_H__
+#define __NDEF_FILE_H__
+
+#include <Arduino.h>
+#include "NfcAdapter.h" // NDEF_MAX_LENGTH
+
+#define NDEF_NLEN_SIZE 2
+
+#define NDEF_HEADER_MB  0x80 // message begin
+#define NDEF_HEADER_ME  0x40 // message end
+#define NDEF_HEADER_SR  0x10 // short record
+#define NDEF_TNF_WELL_KNOWN 0x01
+#define NDEF_TNF_MIME_MEDIA 0x02
+
+#define NDEF_SHORT_RECORD_HEADER_SIZE 3 // header, type length, payload length
+
+// T and P are the sizes of the type and payload literals, terminator included
+template<size_t T, size_t P>
+struct NdefMimeFile {
+    static_assert(T > 1, "mime type must not be empty");
+    static_assert(P - 1 <= 0xFF, "payload too large for a short record");
+
+    static const size_t recordLength = NDEF_SHORT_RECORD_HEADER_SIZE + (T - 1) + (P - 1);
+    static const size_t length = NDEF_NLEN_SIZE + recordLength;
+
+    uint8_t data[length];
+};
+
+template<size_t... I> struct NdefIndices {};
+template<size_t N, size_t... I> struct NdefMakeIndices : NdefMakeIndices<N - 1, N - 1, I...> {};
+template<size_t... I> struct NdefMakeIndices<0, I...> { typedef NdefIndices<I...> type; };
+
+// byte i of the file: NLEN, record header, type, payload
+template<size_t T, size_t P>
+constexpr uint8_t ndefMimeFileByte(const char (&type)[T], const char (&payload)[P], size_t i) {
+    return i == 0 ? (uint8_t)(NdefMimeFile<T, P>::recordLength >> 8)
+         : i == 1 ? (uint8_t)(NdefMimeFile<T, P>::recordLength & 0xFF)
+         : i == 2 ? (uint8_t)(NDEF_HEADER_MB | NDEF_HEADER_ME | NDEF_HEADER_SR | NDEF_TNF_MIME_MEDIA)
+         : i == 3 ? (uint8_t)(T - 1)
+         : i == 4 ? (uint8_t)(P - 1)
+         : i < 5 + (T - 1) ? (uint8_t)type[i - 5]
+         : (uint8_t)payload[i - 5 - (T - 1)];
+}
+
+template<size_t T, size_t P, size_t... I>
+constexpr NdefMimeFile<T, P> ndefMimeFile(const char (&type)[T], const char (&payload)[P], NdefIndices<I...>) {
+    return NdefMimeFile<T, P>{ { ndefMimeFileByte(type, payload, I)... } };
+}
+
+template<size_t T, size_t P>
+constexpr NdefMimeFile<T, P> ndefMimeFile(const char (&type)[T], const char (&payload)[P]) {
+    return ndefMimeFile(type, payload, typename NdefMakeIndices<NdefMimeFile<T, P>::length>::type());
+}
+
+/*
+ * Declares `name` as a flash resident NDEF file holding one mime media record.
+ * Pass `name.data` to MyCard::setNdefFile_P().
+ */
+#define NDEF_MIME_FILE(name, type, payload) \
+    const decltype(ndefMimeFile(type, payload)) name PROGMEM = ndefMimeFile(type, payload); \
+    static_assert(sizeof(name.data) <= NDEF_MAX_LENGTH, "ndef file too large (> NDEF_MAX_LENGTH)")
+
+#endif
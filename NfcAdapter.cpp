@@ -10,7 +10,10 @@
 #include "MNdefMessage.h"
 #include <string.h>
 #include <stdlib.h>
+#include <avr/wdt.h>
 #include "NfcAdapter.h"
+#include "NdefFile.h"
+#include "NfcBench.h"
 
 #define MAX_TGREAD
 #define SERIAL_COMMAND_RECHARGE "rec"
@@ -19,183 +22,455 @@
 
 typedef enum { NONE, CC, NDEF} tag_file;   // CC ... Compatibility Container
 
-typedef enum {S_DISCONNECTED, S_CONNECTED} SerialState;
-
-SerialState serialState;
-CardState cardState;
-Event eventType = NOTHING;
-
-
-String userId;
-String userCredit;
-String controlKeyReceived;
-char amountBuf[6];
-char timestampBuf[19];
-uint8_t secretKey[] = "ABCDEFGHIJ"; //{0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a};
-uint8_t controlKey[] = "";
-uint8_t secret[20];
-int intCount = 0;
-long epoch = 0;
-long transactionId = 10000000;
-int led = 7;
-int led1 = 6;
-int led2 = 5;
-char currentDate[8];
-boolean keyIsUpdated = false;
-String inputCommand = "";         // a string to hold incoming data
-String inputValue = "";
-String inputValue2 = "";
-String otpIn;
-String timestamp = "";
-boolean commandComplete = false;  // whether the string is complete
-boolean valueIn = false;
-boolean valueIn2 = false;
-boolean serialInt = false;
-boolean request = false;
-boolean loggedin = false;
-boolean validIp = false;
-boolean connectedToBackend = false;
-boolean keyRequest = false;
-
-char* otpReceived = "";
-char otp[10];
-char cardId[] = "00005678";
-char cardName[] = "Macchina Prova 1";
-char values[28];
-char transIdBuf[9];
-
-void convertValue(String amount, String time) {
-	//String amount = inputS.substring(0, 5); //inputS.length() - 1);
-	//String time = inputS.substring(6);
-    //int z = inputS.indexOf('-');
-    timestamp = time;
-    amount.toCharArray(amountBuf, sizeof(amountBuf));
-    amountBuf[sizeof(amountBuf) - 1] = 0;
-    time.concat(String(transactionId));
-    time.toCharArray(timestampBuf, sizeof(timestampBuf));
-    timestampBuf[sizeof(timestampBuf) - 1] = 0;
-
-    /*Serial.print("log:inputS=");
-    Serial.print(timestampBuf);
-    Serial.println(';');*/
-
-}
-
-void setCurrentDate(String input){
-
-}
-
-boolean readCommand2() {
-	boolean response = false;
-
-	if(Serial.available() > 0) {
-		char serialBuffer[64];
-
-		Serial.readBytesUntil(10, serialBuffer, 64);
-
-		if(0 == memcmp(serialBuffer, SERIAL_COMMAND_RECHARGE, 3)) {
-			transactionId++;
-			String(transactionId).toCharArray(transIdBuf, sizeof(transIdBuf));
-			memcpy(values, serialBuffer + 4, 20);
-			memcpy(values + 19, transIdBuf, 9);
-			Serial.print("log: recharge ");
-			Serial.print(values);
-			Serial.println(";");
-            cardState = RECHARGE;
-			response = true;
-		} else if (0 == memcmp(serialBuffer, SERIAL_COMMAND_PURCHASE, 3)) {
-			transactionId++;
-			String(transactionId).toCharArray(transIdBuf, sizeof(transIdBuf));
-			memcpy(values, serialBuffer + 4, 20);
-			memcpy(values + 19, transIdBuf, 9);
-			Serial.print("log: purchase ");
-			Serial.print(values);
-			Serial.println(";");
-            cardState = PURCHASE;
-			response = true;
-		} else {
-			Serial.println("log: error;");
-			response = true;
-		}
-	}
-	return response;
-}
-
-boolean readCommand() {
+long MyCard::lastTransactionId = 10000000;
+
+// used until the first set_config:, and whenever no EEPROM slot is valid
+const DeviceConfig defaultConfig PROGMEM = {
+    CONFIG_VERSION, 0,
+    "00005678",
+    "Macchina Prova 1",
+    { 0x12, 0x34, 0x56 },
+    "ABCDEFGHIJ",
+    0x54, C_APDU_MAX_DATA, 0,
+    SESSION_BUDGET, HOST_TIMEOUT_MAX, READER_TIMEOUT_MAX,
+    0
+};
+
+// Window [from, to) of the generated ndef file that is being copied into dst
+struct NdefWindow {
+    uint8_t* dst;
+    uint16_t pos;
+    uint16_t from;
+    uint16_t to;
+};
+
+void ndefPut(NdefWindow* window, const uint8_t* src, uint16_t length, bool flash) {
+    uint16_t start = max(window->pos, window->from);
+    uint16_t end = min(window->pos + length, window->to);
+    if(start < end) {
+        if(flash) {
+            memcpy_P(window->dst + start - window->from, src + start - window->pos, end - start);
+        } else {
+            memcpy(window->dst + start - window->from, src + start - window->pos, end - start);
+        }
+    }
+    window->pos += length;
+}
+
+void ndefPutByte(NdefWindow* window, uint8_t b) {
+    ndefPut(window, &b, 1, false);
+}
+
+void ndefPutString(NdefWindow* window, const char* s) {
+    ndefPut(window, (const uint8_t*)s, strlen(s), false);
+}
+
+/*
+ * true when length bytes at offset lie inside a file of fileLength bytes and fit the R-APDU
+ * buffer with the status word behind them.
+ */
+static bool readable(uint16_t offset, uint8_t length, uint16_t fileLength){
+    return (uint32_t)offset + length <= fileLength && length <= APDU_BUFFER_SIZE - 2;
+}
+
+void MyCard::setCurrentDate(String input){
+    input.toCharArray(currentDate, sizeof(currentDate));
+}
+
+/*
+ * Amount and timestamp of a rec/pur command followed by the transaction id.
+ * Without a timestamp from the host the transaction is stamped with the device clock.
+ */
+void MyCard::setValues(const char* value, uint8_t length){
+    memset(session.values, 0, sizeof(session.values));
+    if(length < 6 + SERIAL_TIME_LENGTH && clockSynced){
+        memcpy(session.values, value, min(length, 5));
+        session.values[5] = ',';
+        formatTime(session.values + 6);
+    } else {
+        memcpy(session.values, value, min(length, 6 + SERIAL_TIME_LENGTH));
+    }
+    memcpy(session.values + 19, session.transIdBuf, 9);
+}
+
+bool MyCard::getTime(uint32_t* seconds, uint16_t* milliseconds){
+    unsigned long elapsed = millis() - epochMillis;
+    // 64 bits: a long overflows after about 30 h without a sync at TIME_DRIFT_MAX_PPM
+    elapsed += (int64_t)elapsed * driftPpm / 1000000;
+    *seconds = epoch + elapsed / 1000;
+    *milliseconds = elapsed % 1000;
+    return clockSynced;
+}
+
+// SERIAL_TIME_LENGTH digits of the device clock, null terminated
+void MyCard::formatTime(char* buf){
+    uint32_t seconds;
+    uint16_t milliseconds;
+    getTime(&seconds, &milliseconds);
+    ultoa(seconds, buf, 10);
+    buf += strlen(buf);
+    buf[0] = '0' + milliseconds / 100;
+    buf[1] = '0' + (milliseconds / 10) % 10;
+    buf[2] = '0' + milliseconds % 10;
+    buf[3] = 0;
+}
+
+/*
+ * set_time value: seconds since 1970, optionally followed by 3 digits of milliseconds.
+ * Answers to our own get_time request that arrive within TIME_SYNC_TIMEOUT measure the drift,
+ * unsolicited ones just step the clock.
+ */
+void MyCard::setTime(String value){
+    uint32_t seconds = strtoul(value.substring(0, 10).c_str(), 0, 10);
+    uint16_t milliseconds = 0;
+    if(value.length() >= SERIAL_TIME_LENGTH){
+        milliseconds = value.substring(10, SERIAL_TIME_LENGTH).toInt();
+    }
+    // later answers sat in the serial buffer for an unknown time, the running clock is better
+    bool requested = timeRequested && millis() - lastTimeRequest <= TIME_SYNC_TIMEOUT;
+    bool late = timeRequested && !requested;
+    timeRequested = false;
+    if(late && clockSynced){
+        return;
+    }
+    if(clockSynced && requested){
+        uint32_t localSeconds;
+        uint16_t localMilliseconds;
+        getTime(&localSeconds, &localMilliseconds);
+        long error = (long)(seconds - localSeconds) * 1000 + milliseconds - localMilliseconds;
+        unsigned long interval = millis() - epochMillis;
+        if(interval >= TIME_DRIFT_MIN_INTERVAL && labs(error) < TIME_DRIFT_MAX_ERROR){
+            // half of the measured error, one late answer must not throw the clock off
+            driftPpm += error * 1000 / (long)(interval / 1000) / 2;
+            driftPpm = constrain(driftPpm, -TIME_DRIFT_MAX_PPM, TIME_DRIFT_MAX_PPM);
+        }
+    }
+    epoch = seconds;
+    epochMillis = millis() - milliseconds;
+    clockSynced = true;
+}
+
+/*
+ * Asks the host for the time when a sync is due, without waiting: housekeeping() takes the
+ * set_time answer. Only called while a phone is served, the host is then read every
+ * READER_POLL_SLICE ms and the answer is not left behind a blocking tgInitAsTarget.
+ */
+void MyCard::syncTime(){
+    unsigned long syncInterval = clockSynced ? TIME_SYNC_INTERVAL : TIME_SYNC_RETRY;
+    if(lastTimeRequest != 0 && millis() - lastTimeRequest <= syncInterval){
+        return;
+    }
+    host.println("get_time:req;");
+    timeRequested = true;
+    lastTimeRequest = millis();
+}
+
+boolean MyCard::readCommand() {
+    BENCH_BEGIN(BENCH_READ_COMMAND);
     boolean serialRead = false;
-    if(Serial.available() > 0) {
+    if(host.available() > 0) {
 
-        while(Serial.available() > 0) {
+        while(host.available() > 0) {
             // get the new byte:
-            char inChar = (char)Serial.read();
+            char inChar = (char)host.read();
+            if ((inChar == '\n' || inChar == '\r') && link.inputCommand.length() == 0) {
+                continue; // line end after a ';' command
+            }
             // add it to the inputString:
-            if(!valueIn) {
-                inputCommand += inChar;
+            if(!link.valueIn) {
+                link.inputCommand += inChar;
             } else {
-            	inputValue += inChar;
+            	link.inputValue += inChar;
             }
             // if the incoming character is a newline, set a flag
             // so the main loop can do something about it:
             if (inChar == ':') {
-                valueIn = true;
+                link.valueIn = true;
             }
-            if (inChar == ';') {
-                commandComplete = true;
+            if (inChar == ';' || inChar == '\n') {
+                link.commandComplete = true;
                 break;
             }
         }
     }
-    if (commandComplete) {
+    if (link.commandComplete) {
         //Serial.println("log:" + inputCommand + "-" + inputValue);
-        if(inputCommand.equals(SERIAL_COMMAND_CONNECTION)) {
-            if(inputValue.equals(SERIAL_RESPONSE_OK)) {
-                serialState = S_CONNECTED;
+        if(link.inputCommand.equals(SERIAL_COMMAND_CONNECTION)) {
+            if(link.inputValue.equals(SERIAL_RESPONSE_OK)) {
+                link.state = S_CONNECTED;
                 digitalWrite(led, HIGH);
+            } else if(link.inputValue.equals(SERIAL_RESPONSE_ERROR)) {
+                link.state = S_DISCONNECTED;
+                digitalWrite(led, LOW);
             }
-        } else if (inputCommand.equals("set_data:")) {
-            if(inputValue.equals(SERIAL_RESPONSE_OK)) {
+            invalidateNdef();
+        } else if (link.inputCommand.equals(SERIAL_COMMAND_SET_PRICES)) {
+            // value still carries the closing ';'
+            link.inputValue.substring(0, link.inputValue.length() - 1).toCharArray(prices, sizeof(prices));
+            invalidateNdef();
+        } else if (link.inputCommand.equals("set_data:")) {
+            if(link.inputValue.equals(SERIAL_RESPONSE_OK)) {
                 
             }
-        } else if (inputCommand.equals(SERIAL_COMMAND_PURCHASE)) {
-            //digitalWrite(led1, HIGH);
-            //Serial.println(inputCommand.concat(SERIAL_RESPONSE_OK));
-        	//Serial.println("log: command purchase;");
-        	transactionId++;
-        	convertValue(inputValue.substring(0, 5), inputValue.substring(6, 16));
-            cardState = PURCHASE;
-            
-        } else if (inputCommand.equals(SERIAL_COMMAND_RECHARGE)) {
-            //digitalWrite(led1, HIGH);
-            //Serial.println(inputCommand.concat(SERIAL_RESPONSE_OK));
-        	//Serial.println("log: command recharge;");
-        	transactionId++;
-        	convertValue(inputValue.substring(0, 5), inputValue.substring(6, 16));
-            cardState = RECHARGE;
-        } else if (inputCommand.equals(SERIAL_COMMAND_GET_TIME)) {
-            
-            //verifyOtpCode(inputValue);
-
-        } else if (inputCommand.equals(SERIAL_COMMAND_GET_DATE)) {
-        	setCurrentDate(inputValue);
+        } else if (link.inputCommand.equals(SERIAL_COMMAND_RECHARGE ":") || link.inputCommand.equals(SERIAL_COMMAND_PURCHASE ":")) {
+            // rec:/pur: lines end with a newline, the value still carries it
+            boolean recharge = link.inputCommand.equals(SERIAL_COMMAND_RECHARGE ":");
+            session.transactionId = nextTransactionId();
+            String(session.transactionId).toCharArray(session.transIdBuf, sizeof(session.transIdBuf));
+            setValues(link.inputValue.c_str(), link.inputValue.length() - 1);
+            host.print(recharge ? "log: recharge " : "log: purchase ");
+            host.print(session.values);
+            host.println(";");
+            session.cardState = recharge ? RECHARGE : PURCHASE;
+        } else if (link.inputCommand.equals(SERIAL_COMMAND_SET_TIME)) {
+            setTime(link.inputValue.substring(0, link.inputValue.length() - 1));
+        } else if (link.inputCommand.equals(SERIAL_COMMAND_GET_TIME)) {
+            char time[SERIAL_TIME_LENGTH + 1];
+            formatTime(time);
+            host.print(SERIAL_COMMAND_GET_TIME);
+            host.print(time);
+            host.println(";");
+        } else if (link.inputCommand.equals(SERIAL_COMMAND_SET_CONFIG)) {
+            // all fields or none: parsed over a copy of the config, answered once it is persisted
+            char value[96];
+            link.inputValue.substring(0, link.inputValue.length() - 1).toCharArray(value, sizeof(value));
+            DeviceConfig parsed = configPending > 0 ? pendingConfig : config;
+            if(link.inputValue.length() <= sizeof(value) && parseConfig(value, &parsed)){
+                pendingConfig = parsed;
+                configPending++;
+                if(!sessionOpen){
+                    commitConfig();
+                }
+            } else {
+                host.println(SERIAL_COMMAND_SET_CONFIG SERIAL_RESPONSE_ERROR);
+            }
+        } else if (link.inputCommand.equals(SERIAL_COMMAND_GET_CONFIG)) {
+            printConfig();
+        } else if (link.inputCommand.equals(SERIAL_COMMAND_CLEAR_NDEF)) {
+            // the phone keeps reading the file it selected, the EEPROM is written after it left
+            if(sessionOpen){
+                clearPending = true;
+            } else {
+                commitClearNdef();
+            }
+        } else if (link.inputCommand.equals(SERIAL_COMMAND_GET_DIAG)) {
+            host.print("diag:");
+            host.print(diagnostics.sessions);
+            host.print(",");
+            host.print(diagnostics.hostTimeouts);
+            host.print(",");
+            host.print(diagnostics.readerTimeouts);
+            host.print(",");
+            host.print(diagnostics.readerErrors);
+            host.print(",");
+            host.print(diagnostics.budgetOverruns);
+            host.print(",");
+            host.print(connectTimeout.timeout());
+            host.print(",");
+            host.print(dataTimeout.timeout());
+            host.print(",");
+            host.print(readerTimeout.timeout());
+            host.println(";");
+        } else if (link.inputCommand.equals(SERIAL_COMMAND_GET_DATE)) {
+        	setCurrentDate(link.inputValue);
+        }
+        if(link.awaited != 0 && link.inputCommand.equals(link.awaited)){
+            link.reply = link.inputValue.equals(SERIAL_RESPONSE_OK) ? REPLY_OK : REPLY_ERROR;
         }
-        inputCommand = "";
-        inputValue = "";
-        inputValue2 = "";
-        valueIn = false;
-        valueIn2 = false;
-        commandComplete = false;
+        link.inputCommand = "";
+        link.inputValue = "";
+        link.valueIn = false;
+        link.commandComplete = false;
         serialRead = true;
     }
+    BENCH_END(BENCH_READ_COMMAND);
     return serialRead;
 }
 
-bool MyCard::init(){
+bool MyCard::init(int configAddress){
+    this->configAddress = configAddress;
+    if(!loadConfig()){
+        host.println("log: default config;");
+    }
+    applyConfig();
+    loadNdef();
+    pinMode(led, OUTPUT);
+    // a wait that hangs resets the board instead of freezing the machine;
+    // the bootloader must clear the watchdog after a reset (optiboot or a recent stk500v2)
+    wdt_enable(WATCHDOG_TIMEOUT);
     pn532.begin();
     return pn532.SAMConfig();
 }
 
-void MyCard::setId(char id[]) {
-	//memcpy(id, cardId, 8);
+void MyCard::setId(const char* id) {
+    strncpy(config.id, id, CONFIG_ID_LENGTH);
+    config.id[CONFIG_ID_LENGTH] = 0;
+    invalidateNdef();
+}
+
+void MyCard::setName(const char* name) {
+    strncpy(config.name, name, sizeof(config.name) - 1);
+    config.name[sizeof(config.name) - 1] = 0;
+    invalidateNdef();
+}
+
+void MyCard::resetConfig(){
+    memcpy_P(&config, &defaultConfig, sizeof(config));
+    configAddress = CONFIG_ADDRESS;
+    configSlot = 1; // the first save goes to slot 0
+}
+
+/*
+ * Copies the newest valid slot to ram, the only EEPROM read of the boot.
+ * @return false when no slot is valid, the defaults stay in place
+ */
+bool MyCard::loadConfig(){
+    DeviceConfig slots[2];
+    eepromRead(configAddress, slots, sizeof(slots));
+    bool valid0 = configValid(&slots[0]);
+    bool valid1 = configValid(&slots[1]);
+    if(!valid0 && !valid1){
+        return false;
+    }
+    configSlot = (valid1 && (!valid0 || configNewer(slots[1].sequence, slots[0].sequence))) ? 1 : 0;
+    config = slots[configSlot];
+    return true;
+}
+
+bool MyCard::saveConfig(){
+    DeviceConfig next = config;
+    next.version = CONFIG_VERSION;
+    next.sequence++;
+    next.crc = configCrc(&next);
+    uint8_t slot = configSlot ^ 1;
+    // the current slot stays valid until this one is complete
+    if(!eepromUpdate(configAddress + slot * sizeof(DeviceConfig), &next, sizeof(next))){
+        return false;
+    }
+    config = next;
+    configSlot = slot;
+    return true;
+}
+
+/*
+ * Persists and applies the config of the last set_config: and answers it. Held back while a
+ * phone is served: the EEPROM write and the reset of the learned timeouts and of the write
+ * access do not belong in the middle of a session.
+ */
+void MyCard::commitConfig(){
+    DeviceConfig previous = config;
+    config = pendingConfig;
+    bool saved = saveConfig();
+    if(saved){
+        applyConfig();
+    } else {
+        config = previous;
+    }
+    // every set_config: of the session was merged into pendingConfig, each gets its answer
+    for(; configPending > 0; configPending--){
+        host.println(saved ? SERIAL_COMMAND_SET_CONFIG SERIAL_RESPONSE_OK : SERIAL_COMMAND_SET_CONFIG SERIAL_RESPONSE_ERROR);
+    }
+}
+
+void MyCard::applyConfig(){
+    // blocks saved by an older firmware may exceed today's limits
+    config.maxRead = constrain(config.maxRead, 1, CONFIG_MAX_READ);
+    config.maxWrite = constrain(config.maxWrite, 1, C_APDU_MAX_DATA);
+    config.hostTimeout = constrain(config.hostTimeout, HOST_TIMEOUT_MIN, TIMEOUT_LIMIT);
+    config.readerTimeout = constrain(config.readerTimeout, READER_TIMEOUT_MIN, TIMEOUT_LIMIT);
+    // what was learned under the old bounds does not hold for the new ones
+    connectTimeout = AdaptiveTimeout(HOST_TIMEOUT_MIN, config.hostTimeout);
+    dataTimeout = AdaptiveTimeout(HOST_TIMEOUT_MIN, config.hostTimeout);
+    readerTimeout = AdaptiveTimeout(READER_TIMEOUT_MIN, config.readerTimeout);
+    tagWriteable = !config.locked;
+    invalidateNdef();
+}
+
+/*
+ * Parses "key=value,key=value" into parsed, keys left out keep their value.
+ * Keys: id, name, uid (6 hex digits), key, read, write, lock, budget, host, reader.
+ * @return false on an unknown key or a value out of range, parsed is then unusable
+ */
+bool MyCard::parseConfig(char* value, DeviceConfig* parsed){
+    char* field = strtok(value, ",");
+    while(field != 0){
+        char* eq = strchr(field, '=');
+        if(eq == 0){
+            return false;
+        }
+        *eq = 0;
+        const char* v = eq + 1;
+        uint8_t length = strlen(v);
+        char* end;
+        unsigned long number = strtoul(v, &end, strcmp(field, "uid") == 0 ? 16 : 10);
+        bool isNumber = length > 0 && *end == 0;
+        if(strcmp(field, "id") == 0){
+            if(length != CONFIG_ID_LENGTH) return false;
+            memcpy(parsed->id, v, length + 1);
+        } else if(strcmp(field, "name") == 0){
+            if(length == 0 || length >= sizeof(parsed->name)) return false;
+            memcpy(parsed->name, v, length + 1);
+        } else if(strcmp(field, "key") == 0){
+            if(length != CONFIG_KEY_LENGTH) return false;
+            memcpy(parsed->secretKey, v, length + 1);
+        } else if(strcmp(field, "uid") == 0){
+            if(length != 6 || !isNumber) return false;
+            parsed->uid[0] = number >> 16;
+            parsed->uid[1] = number >> 8;
+            parsed->uid[2] = number;
+        } else if(strcmp(field, "read") == 0){
+            if(!isNumber || number < 1 || number > CONFIG_MAX_READ) return false;
+            parsed->maxRead = number;
+        } else if(strcmp(field, "write") == 0){
+            if(!isNumber || number < 1 || number > C_APDU_MAX_DATA) return false;
+            parsed->maxWrite = number;
+        } else if(strcmp(field, "lock") == 0){
+            if(!isNumber || number > 1) return false;
+            parsed->locked = number;
+        } else if(strcmp(field, "budget") == 0){
+            if(!isNumber || number < 1000 || number > 0xFFFF) return false;
+            parsed->sessionBudget = number;
+        } else if(strcmp(field, "host") == 0){
+            if(!isNumber || number < HOST_TIMEOUT_MIN || number > TIMEOUT_LIMIT) return false;
+            parsed->hostTimeout = number;
+        } else if(strcmp(field, "reader") == 0){
+            if(!isNumber || number < READER_TIMEOUT_MIN || number > TIMEOUT_LIMIT) return false;
+            parsed->readerTimeout = number;
+        } else {
+            return false;
+        }
+        field = strtok(0, ",");
+    }
+    return true;
+}
+
+// same format as set_config:, the key is never sent back
+void MyCard::printConfig(){
+    char uid[7];
+    for(uint8_t i = 0; i < 3; i++){
+        uid[i * 2] = "0123456789abcdef"[config.uid[i] >> 4];
+        uid[i * 2 + 1] = "0123456789abcdef"[config.uid[i] & 0x0F];
+    }
+    uid[6] = 0;
+    host.print("config:id=");
+    host.print(config.id);
+    host.print(",name=");
+    host.print(config.name);
+    host.print(",uid=");
+    host.print(uid);
+    host.print(",read=");
+    host.print(config.maxRead);
+    host.print(",write=");
+    host.print(config.maxWrite);
+    host.print(",lock=");
+    host.print(config.locked);
+    host.print(",budget=");
+    host.print(config.sessionBudget);
+    host.print(",host=");
+    host.print(config.hostTimeout);
+    host.print(",reader=");
+    host.print(config.readerTimeout);
+    host.println(";");
 }
 
 void MyCard::setNdefFile(const uint8_t* ndef, const int16_t ndefLength){
@@ -207,6 +482,103 @@ void MyCard::setNdefFile(const uint8_t* ndef, const int16_t ndefLength){
     ndef_file[0] = ndefLength >> 8;
     ndef_file[1] = ndefLength & 0xFF;
     memcpy(ndef_file+2, ndef, ndefLength);
+    ndefFileP = 0;
+}
+
+void MyCard::setNdefFile_P(const uint8_t* ndef){
+    uint16_t ndefLength = (pgm_read_byte(ndef) << 8) + pgm_read_byte(ndef + 1);
+    if(ndefLength > (NDEF_MAX_LENGTH -2)){
+        DMSG("ndef file too large (> NDEF_MAX_LENGHT -2) - aborting");
+        return;
+    }
+    ndefFileP = ndef;
+}
+
+void MyCard::invalidateNdef(){
+    ndefStale = true;
+}
+
+long MyCard::nextTransactionId(){
+    return ++lastTransactionId;
+}
+
+/*
+ * Emits the generated ndef file into window: NLEN, the flash record (if set) and a text record
+ * "<name> #<id> | <prices> | online", from the inputs frozen by freezeNdef().
+ * Only the bytes inside the window are copied.
+ */
+void MyCard::generateNdef(NdefWindow* window){
+    const char* connection = frozenOnline ? "online" : "offline";
+    const char* prices = frozenPrices;
+    uint16_t flashLength = 0;
+    if(ndefFileP != 0){
+        flashLength = (pgm_read_byte(ndefFileP) << 8) + pgm_read_byte(ndefFileP + 1);
+    }
+    // the file must fit the NDEF_MAX_LENGTH advertised in the CC: the prices go first, then the text record
+    int16_t room = NDEF_MAX_LENGTH - NDEF_NLEN_SIZE - flashLength - (NDEF_SHORT_RECORD_HEADER_SIZE + 1 + 3);
+    uint16_t textLength = strlen(config.name) + 2 + strlen(config.id) + 3 + strlen(connection);
+    bool withPrices = prices[0] != 0 && (int16_t)(textLength + strlen(prices) + 3) <= room;
+    if(withPrices){
+        textLength += strlen(prices) + 3;
+    }
+    bool withText = (int16_t)textLength <= room;
+    uint8_t payloadLength = 3 + textLength; // status byte + language code
+    uint16_t recordLength = withText ? NDEF_SHORT_RECORD_HEADER_SIZE + 1 + payloadLength : 0;
+    uint16_t nlen = flashLength + recordLength;
+
+    ndefPutByte(window, nlen >> 8);
+    ndefPutByte(window, nlen & 0xFF);
+    uint8_t header = NDEF_HEADER_MB | NDEF_HEADER_ME | NDEF_HEADER_SR | NDEF_TNF_WELL_KNOWN;
+    if(flashLength > 0){
+        // the flash record opens the message so the app still gets launched
+        uint8_t flashHeader = pgm_read_byte(ndefFileP + 2);
+        ndefPutByte(window, withText ? flashHeader & ~NDEF_HEADER_ME : flashHeader);
+        ndefPut(window, ndefFileP + 3, flashLength - 1, true);
+        header &= ~NDEF_HEADER_MB;
+    }
+    if(!withText){
+        return;
+    }
+    ndefPutByte(window, header);
+    ndefPutByte(window, 1);
+    ndefPutByte(window, payloadLength);
+    ndefPutByte(window, 'T');
+    ndefPutByte(window, 2);
+    ndefPutString(window, "it");
+    ndefPutString(window, config.name);
+    ndefPutString(window, " #");
+    ndefPutString(window, config.id);
+    ndefPutString(window, " | ");
+    if(withPrices){
+        ndefPutString(window, prices);
+        ndefPutString(window, " | ");
+    }
+    ndefPutString(window, connection);
+}
+
+/*
+ * NLEN and the body come in separate reads while the host keeps changing the machine state:
+ * the inputs are copied once per session, the length is only recomputed when they changed.
+ */
+void MyCard::freezeNdef(){
+    if(ndefStale){
+        frozenOnline = link.state == S_CONNECTED;
+        memcpy(frozenPrices, prices, sizeof(frozenPrices));
+        NdefWindow window = { 0, 0, 0, 0 };
+        generateNdef(&window);
+        generatedLength = window.pos;
+        ndefStale = false;
+    }
+    ndefFrozen = true;
+}
+
+// past generatedLength the file reads as zeros, nothing needs to be generated
+void MyCard::readGeneratedNdef(uint8_t* buf, uint16_t offset, uint8_t length){
+    memset(buf, 0, length);
+    if(offset < generatedLength){
+        NdefWindow window = { buf, 0, offset, (uint16_t)(offset + length) };
+        generateNdef(&window);
+    }
 }
 
 void MyCard::setUid(uint8_t* uid){
@@ -214,11 +586,17 @@ void MyCard::setUid(uint8_t* uid){
 }
 
 bool MyCard::emulate(const uint16_t tgInitAsTargetTimeout){
-	eventType = NOTHING;
-	connectedToBackend = false;
-    userCredit = "0.0";
-    userId = "";
-    loggedin = false;
+	session.eventType = NOTHING;
+	session.connectedToBackend = false;
+    session.userCredit = "0.0";
+    session.userId = "";
+    session.loggedin = false;
+    session.appSelected = false;
+    session.cardState = WAITING;
+
+    wdt_reset();
+    // commands that came in while no phone was there
+    housekeeping();
     
     const uint8_t ndef_tag_application_name_v2[] = {0, 0x7, 0xD2, 0x76, 0x00, 0x00, 0x85, 0x01, 0x01 };
     const uint8_t ndef_tag_application_name_priv[] = {0, 0x7, 0xFF, 0x00, 0x00, 0x00, 0x00, 0x12, 0x34};
@@ -246,18 +624,29 @@ bool MyCard::emulate(const uint16_t tgInitAsTargetTimeout){
         memcpy(command + 4, uidPtr, 3);
     }
     
-    if(1 != pn532.tgInitAsTarget(command,sizeof(command), tgInitAsTargetTimeout)){
+    // tgInitAsTarget blocks without kicking the watchdog, never longer than TG_INIT_TIMEOUT_MAX
+    uint16_t initTimeout = tgInitAsTargetTimeout;
+    if(initTimeout == 0 || initTimeout > TG_INIT_TIMEOUT_MAX){
+        initTimeout = TG_INIT_TIMEOUT_MAX;
+    }
+    wdt_reset();
+    int8_t initStatus = pn532.tgInitAsTarget(command,sizeof(command), initTimeout);
+    wdt_reset();
+    if(1 != initStatus){
         DMSG("log:tgInitAsTarget failed or timed out!;");
-        Serial.println("log: init as target timeout;");
+        host.println("log: init as target timeout;");
         return false;
     }
-    Serial.println("log:target inizializzato;");
+    host.println("log:target inizializzato;");
+    sessionStart = millis();
+    sessionOpen = true;
+    diagnostics.sessions++;
     
     uint8_t base_capability_container[] = {
         0, 0x0F,    //CC length
         0x20,       //Mapping Version ---> version 2.0
-        0, 0x54,    //Max data read
-        0, 0xFF,    //Max data write
+        0, config.maxRead,  //Max data read
+        0, (uint8_t)min(config.maxWrite, C_APDU_MAX_DATA), //Max data write, must fit capdu
         0x04,       // T
         0x06,       // L
         0xE1, 0x04, // File identifier
@@ -271,9 +660,12 @@ bool MyCard::emulate(const uint16_t tgInitAsTargetTimeout){
     }
     
     tagWrittenByInitiator = false;
+    shadowLoaded = false;
+    ndefFrozen = false;
     
     
-    uint8_t rwbuf[128];
+    uint8_t capdu[APDU_BUFFER_SIZE]; // command from the initiator
+    uint8_t rapdu[APDU_BUFFER_SIZE]; // response, handed to the PN532 without another copy
     uint8_t sendlen;
     int16_t status;
     tag_file currentFile = NONE;
@@ -281,11 +673,18 @@ bool MyCard::emulate(const uint16_t tgInitAsTargetTimeout){
     bool runLoop = true;
     
     while(runLoop){
-        status = pn532.tgGetData(rwbuf, sizeof(rwbuf));
+        wdt_reset();
+        if(sessionRemaining() == 0){
+            diagnostics.budgetOverruns++;
+            host.println("log: session budget exceeded;");
+            break;
+        }
+        status = receiveCommand(capdu, sizeof(capdu));
         if(status < 0){
+            // phone gone or reader error, never run the previous command again
             DMSG("tgGetData timed out\n");
-            //pn532.inRelease();
-            //return -1;
+            host.println("log: tgGetData failed;");
+            break;
         }
         
         /*uint32_t field = pn532.getGeneralStatus();
@@ -295,45 +694,56 @@ bool MyCard::emulate(const uint16_t tgInitAsTargetTimeout){
         Serial.print(", ");Serial.print((field>>8) & 0xFF, DEC);
         Serial.print(", ");Serial.print(field  & 0xFF, DEC);Serial.println(";");*/
 
-        uint8_t p1 = rwbuf[C_APDU_P1];
-        uint8_t p2 = rwbuf[C_APDU_P2];
-        uint8_t lc = rwbuf[C_APDU_LC];
+        uint8_t p1 = capdu[C_APDU_P1];
+        uint8_t p2 = capdu[C_APDU_P2];
+        uint8_t lc = capdu[C_APDU_LC];
         uint16_t p1p2_length = ((int16_t) p1 << 8) + p2;
 
         
-        switch(rwbuf[C_APDU_INS]){
+        uint8_t ins = capdu[C_APDU_INS];
+        BENCH_BEGIN(ins);
+        switch(ins){
             case SELECT_FILE:
                 switch(p1){
                     case C_APDU_P1_SELECT_BY_ID:
                         if(p2 != 0x0c){
                             DMSG("C_APDU_P2 != 0x0c\n");
-                            setResponse(COMMAND_COMPLETE, rwbuf, &sendlen);
-                        } else if(lc == 2 && rwbuf[C_APDU_DATA] == 0xE1 && (rwbuf[C_APDU_DATA+1] == 0x03 || rwbuf[C_APDU_DATA+1] == 0x04)){
-                            setResponse(COMMAND_COMPLETE, rwbuf, &sendlen);
-                            if(rwbuf[C_APDU_DATA+1] == 0x03){
+                            setResponse(COMMAND_COMPLETE, rapdu, &sendlen);
+                        } else if(lc == 2 && capdu[C_APDU_DATA] == 0xE1 && (capdu[C_APDU_DATA+1] == 0x03 || capdu[C_APDU_DATA+1] == 0x04)){
+                            setResponse(COMMAND_COMPLETE, rapdu, &sendlen);
+                            if(capdu[C_APDU_DATA+1] == 0x03){
                                 currentFile = CC;
-                            } else if(rwbuf[C_APDU_DATA+1] == 0x04){
+                            } else if(capdu[C_APDU_DATA+1] == 0x04){
                                 currentFile = NDEF;
+                                if(ndefGenerated && !ndefFrozen){
+                                    freezeNdef();
+                                }
                             }
                         } else {
-                            setResponse(TAG_NOT_FOUND, rwbuf, &sendlen);
+                            setResponse(TAG_NOT_FOUND, rapdu, &sendlen);
                         }
                         break;
                     case C_APDU_P1_SELECT_BY_NAME:
-                        if(0 == memcmp(ndef_tag_application_name_v2, rwbuf + C_APDU_P2, sizeof(ndef_tag_application_name_v2))){
-                            cardState = CONNECTED;
-                            setResponse(COMMAND_COMPLETE, rwbuf, &sendlen);
-                        } else if (0 == memcmp(ndef_tag_application_name_priv, rwbuf + C_APDU_P2, sizeof(ndef_tag_application_name_priv))){
+                        if(0 == memcmp(ndef_tag_application_name_v2, capdu + C_APDU_P2, sizeof(ndef_tag_application_name_v2))){
+                            session.cardState = CONNECTED;
+                            setResponse(COMMAND_COMPLETE, rapdu, &sendlen);
+                        } else if (0 == memcmp(ndef_tag_application_name_priv, capdu + C_APDU_P2, sizeof(ndef_tag_application_name_priv))){
                             DMSG("\nOK");
-                            Serial.println("connection:req;");
-                            while (!readCommand()) {
-                                delay(10);
+                            host.println("connection:req;");
+                            BENCH_PAUSE(ins);
+                            HostReply reply = waitHost(SERIAL_COMMAND_CONNECTION, &connectTimeout);
+                            BENCH_RESUME(ins);
+                            if(reply == REPLY_OK){
+                                session.appSelected = true;
+                                setResponse(PRIV_APPLICATION_SELECTED, rapdu, &sendlen);
+                            } else {
+                                host.println(reply == REPLY_TIMEOUT ? "log: host timeout;" : "log: host refused;");
+                                setResponse(FUNCTION_NOT_SUPPORTED, rapdu, &sendlen);
+                                runLoop = false;
                             }
-                            setResponse(PRIV_APPLICATION_SELECTED, rwbuf, &sendlen);
-                            
                         } else {
                             DMSG("function not supported\n");
-                            setResponse(FUNCTION_NOT_SUPPORTED, rwbuf, &sendlen);
+                            setResponse(FUNCTION_NOT_SUPPORTED, rapdu, &sendlen);
                         }
                         break;
                 }
@@ -341,32 +751,77 @@ bool MyCard::emulate(const uint16_t tgInitAsTargetTimeout){
             case READ_BINARY:
                 switch(currentFile){
                     case NONE:
-                        setResponse(TAG_NOT_FOUND, rwbuf, &sendlen);
+                        setResponse(TAG_NOT_FOUND, rapdu, &sendlen);
                         break;
                     case CC:
-                        if( p1p2_length > NDEF_MAX_LENGTH){
-                            setResponse(END_OF_FILE_BEFORE_REACHED_LE_BYTES, rwbuf, &sendlen);
+                        if(!readable(p1p2_length, lc, cc_size)){
+                            setResponse(END_OF_FILE_BEFORE_REACHED_LE_BYTES, rapdu, &sendlen);
                         }else {
-                            memcpy(rwbuf,base_capability_container + p1p2_length, lc);
-                            setResponse(COMMAND_COMPLETE, rwbuf + lc, &sendlen, lc);
+                            memcpy(rapdu,base_capability_container + p1p2_length, lc);
+                            setResponse(COMMAND_COMPLETE, rapdu + lc, &sendlen, lc);
                         }
                         break;
                     case NDEF:
-                        if( p1p2_length > NDEF_MAX_LENGTH){
-                            setResponse(END_OF_FILE_BEFORE_REACHED_LE_BYTES, rwbuf, &sendlen);
-                        }else {
-                            memcpy(rwbuf, ndef_file + p1p2_length, lc);
-                            setResponse(COMMAND_COMPLETE, rwbuf + lc, &sendlen, lc);
+                        if(shadowLoaded){
+                            // phones read back what they just wrote
+                            if(!readable(p1p2_length, lc, NDEF_MAX_LENGTH)){
+                                setResponse(END_OF_FILE_BEFORE_REACHED_LE_BYTES, rapdu, &sendlen);
+                            } else {
+                                memcpy(rapdu, ndefShadow + p1p2_length, lc);
+                                setResponse(COMMAND_COMPLETE, rapdu + lc, &sendlen, lc);
+                            }
+                        } else if(ndefWritten || (ndefFileP == 0 && !ndefGenerated)){
+                            if(!readable(p1p2_length, lc, NDEF_MAX_LENGTH)){
+                                setResponse(END_OF_FILE_BEFORE_REACHED_LE_BYTES, rapdu, &sendlen);
+                            } else {
+                                memcpy(rapdu, ndef_file + p1p2_length, lc);
+                                setResponse(COMMAND_COMPLETE, rapdu + lc, &sendlen, lc);
+                            }
+                        } else if(ndefGenerated){
+                            if(!readable(p1p2_length, lc, NDEF_MAX_LENGTH)){
+                                setResponse(END_OF_FILE_BEFORE_REACHED_LE_BYTES, rapdu, &sendlen);
+                            } else {
+                                readGeneratedNdef(rapdu, p1p2_length, lc);
+                                setResponse(COMMAND_COMPLETE, rapdu + lc, &sendlen, lc);
+                            }
+                        } else {
+                            // the flash object ends with the message, nothing may be read past it
+                            uint16_t flashSize = (pgm_read_byte(ndefFileP) << 8) + pgm_read_byte(ndefFileP + 1) + 2;
+                            if(!readable(p1p2_length, lc, flashSize)){
+                                setResponse(END_OF_FILE_BEFORE_REACHED_LE_BYTES, rapdu, &sendlen);
+                            } else {
+                                memcpy_P(rapdu, ndefFileP + p1p2_length, lc);
+                                setResponse(COMMAND_COMPLETE, rapdu + lc, &sendlen, lc);
+                            }
                         }
                         break;
                 }
                 break;
+            case UPDATE_BINARY:
+                if(currentFile != NDEF || !tagWriteable){
+                    setResponse(FUNCTION_NOT_SUPPORTED, rapdu, &sendlen);
+                } else if(C_APDU_DATA + lc > status){
+                    // lc claims more data than the PN532 delivered
+                    setResponse(WRONG_LENGTH, rapdu, &sendlen);
+                } else if(p1p2_length + lc > NDEF_MAX_LENGTH){
+                    setResponse(END_OF_FILE_BEFORE_REACHED_LE_BYTES, rapdu, &sendlen);
+                } else {
+                    // fragments are collected in the shadow file and committed once the session ends
+                    if(!shadowLoaded){
+                        loadShadow();
+                        shadowLoaded = true;
+                    }
+                    shadowDirty = true;
+                    memcpy(ndefShadow + p1p2_length, capdu + C_APDU_DATA, lc);
+                    setResponse(COMMAND_COMPLETE, rapdu, &sendlen);
+                }
+                break;
             case LOG_IN:
                 if((p1 == 0x00) && (p2 == 0x00)) {
                     DMSG("\nLoggin in... ");
                     char string[20];
                     for (int i = 0; i <= lc; i++) {
-                        string[i] = (char)rwbuf[C_APDU_DATA + i];
+                        string[i] = (char)capdu[C_APDU_DATA + i];
                         //Serial.write(rwbuf[C_APDU_DATA + i]);
                     }
                     string[lc] = '\0';
@@ -375,30 +830,35 @@ bool MyCard::emulate(const uint16_t tgInitAsTargetTimeout){
                     //int z = s.lastIndexOf(',');
                     int y = s.indexOf(';');
                     //controlKeyReceived = s.substring(0, z - 1);
-                    userId = s.substring(0, x -1);
-                    userCredit = s.substring(x + 1, y);
-                    Serial.print("log:");
-                    Serial.print(s);
-                    Serial.println(";");
-                    Serial.print("set_data:");
-                    Serial.print(userCredit);
-                    Serial.println(";");
-                    delay(100);
-
-                    while (!readCommand()) {
-                        delay(10);
+                    session.userId = s.substring(0, x -1);
+                    session.userCredit = s.substring(x + 1, y);
+                    host.print("log:");
+                    host.print(s);
+                    host.println(";");
+                    host.print("set_data:");
+                    host.print(session.userCredit);
+                    host.println(";");
+
+                    BENCH_PAUSE(ins);
+                    HostReply reply = waitHost(SERIAL_COMMAND_SET_DATA, &dataTimeout);
+                    BENCH_RESUME(ins);
+                    if(reply != REPLY_OK){
+                        host.println(reply == REPLY_TIMEOUT ? "log: host timeout;" : "log: host refused;");
+                        setResponse(AUTH_ERROR, rapdu, &sendlen);
+                        runLoop = false;
+                        break;
                     }
 
-                    Serial.print("log: control key=");
-                    Serial.print(controlKeyReceived);
-                    Serial.println(";");
-                    cardState = WAITING;
-                    setResponse(COMMAND_COMPLETE, rwbuf, &sendlen);
-                    if(!loggedin) {
-                        //eventType = LOGIN;
-                    	Serial.println("log: login;");
+                    host.print("log: control key=");
+                    host.print(session.controlKeyReceived);
+                    host.println(";");
+                    session.cardState = WAITING;
+                    setResponse(COMMAND_COMPLETE, rapdu, &sendlen);
+                    if(!session.loggedin) {
+                        //session.eventType = LOGIN;
+                    	host.println("log: login;");
                         //sendRequest(LOGIN);
-                        loggedin = true;
+                        session.loggedin = true;
                     }
 
                 }
@@ -406,71 +866,299 @@ bool MyCard::emulate(const uint16_t tgInitAsTargetTimeout){
             case READING_STATUS:
                 if((p1 == 0x00) && (p2 == 0x00)) {
                     
-                    readCommand2();
-                    
+                    // rec/pur lines were already parsed by housekeeping(), pick up a late one
+                    housekeeping();
                     //waitingSerial();
-                    switch (cardState) {
+                    switch (session.cardState) {
                         case WAITING:
-                            cardState = WAITING;
-                            Serial.println("log: status WAITING;");
-                            setResponse(STATUS_WAITING, rwbuf, &sendlen);
-                            eventType = NOTHING;
+                            session.cardState = WAITING;
+                            host.println("log: status WAITING;");
+                            setResponse(STATUS_WAITING, rapdu, &sendlen);
+                            session.eventType = NOTHING;
                             break;
                         case RECHARGE:
-                            cardState = WAITING;
-                            Serial.print("log: status RECHARGED ");
-                            Serial.print("transaction ID = ");
-                            Serial.print(transactionId);
-                            Serial.println(";");
-                            setResponse(STATUS_RECHARGED, rwbuf, &sendlen);
+                            session.cardState = WAITING;
+                            host.print("log: status RECHARGED ");
+                            host.print("transaction ID = ");
+                            host.print(session.transactionId);
+                            host.println(";");
+                            setResponse(STATUS_RECHARGED, rapdu, &sendlen);
                             //sendRequest(RECHARGE_TRANSACTION);
-                            //eventType = RECHARGE_TRANSACTION;
+                            //session.eventType = RECHARGE_TRANSACTION;
                             break;
                         case PURCHASE:
-                            cardState = WAITING;
-                            Serial.print("log: status PURCHASE ");
-                            Serial.print("transaction ID = ");
-                            Serial.print(transactionId);
-                            Serial.println(";");
-                            setResponse(STATUS_PURCHASE, rwbuf, &sendlen);
+                            session.cardState = WAITING;
+                            host.print("log: status PURCHASE ");
+                            host.print("transaction ID = ");
+                            host.print(session.transactionId);
+                            host.println(";");
+                            setResponse(STATUS_PURCHASE, rapdu, &sendlen);
                             //sendRequest(PURCHASE_TRANSACTION);
-                            //eventType = PURCHASE_TRANSACTION;
+                            //session.eventType = PURCHASE_TRANSACTION;
                             break;
                     }
-                    delay(50);
+                    BENCH_PAUSE(ins);
+                    delay(STATUS_POLL_DELAY);
+                    BENCH_RESUME(ins);
                     
                 }
                 break;
             default:
                 DMSG("Command not supported!");
-                DMSG_HEX(rwbuf[C_APDU_INS]);
+                DMSG_HEX(capdu[C_APDU_INS]);
                 DMSG("\n");
                 runLoop = false;
-                Serial.println("log:command not supported;");
-                setResponse(FUNCTION_NOT_SUPPORTED, rwbuf, &sendlen);
+                host.println("log:command not supported;");
+                setResponse(FUNCTION_NOT_SUPPORTED, rapdu, &sendlen);
                 break;
         }
-        Serial.println("log:uscito da switch;");
-        status = pn532.tgSetData(rwbuf, sendlen);
-        if(status == 0){
+        BENCH_END(ins);
+        DMSG("uscito da switch\n");
+        if(!sendResponse(rapdu, sendlen)){
             DMSG("tgSetData failed\n!");
             DMSG("\n In Release 1");
-            Serial.println("log:set data failed in release;");
+            host.println("log:set data failed in release;");
             pn532.inRelease();
             break;
         }
         //checkSerial();
-        //sendRequest(eventType);
+        //sendRequest(session.eventType);
     }
-    Serial.println("log:uscito da while;");
+    host.println("log:uscito da while;");
     DMSG("\nIn Release 2");
-    Serial.println("log:in release;");
+    host.println("log:in release;");
     pn532.inRelease();
+    sessionOpen = false;
+    if(shadowDirty){
+        commitShadow();
+    } else if(ndefUnsaved){
+        ndefUnsaved = !saveNdef();
+    }
+    // host commands that change the state were held back while the phone was served
+    if(clearPending){
+        commitClearNdef();
+    }
+    if(configPending > 0){
+        commitConfig();
+    }
     return true;
 }
 
+/*
+ * Waits for the host to answer command with ok or err, within the learned timeout and what is
+ * left of the session budget. Other lines are handled as usual meanwhile. Answers teach the
+ * timeout, a timeout backs it off.
+ */
+HostReply MyCard::waitHost(const char* command, AdaptiveTimeout* timeout){
+    unsigned long start = millis();
+    unsigned long limit = min((unsigned long)timeout->timeout(), sessionRemaining());
+    link.awaited = command;
+    link.reply = REPLY_TIMEOUT;
+    while(link.reply == REPLY_TIMEOUT && millis() - start < limit){
+        readCommand();
+        wdt_reset();
+    }
+    link.awaited = 0;
+    if(link.reply == REPLY_TIMEOUT){
+        diagnostics.hostTimeouts++;
+        timeout->backoff();
+    } else {
+        timeout->observe(millis() - start);
+    }
+    return link.reply;
+}
+
+unsigned long MyCard::sessionRemaining(){
+    unsigned long used = millis() - sessionStart;
+    return used >= config.sessionBudget ? 0 : config.sessionBudget - used;
+}
+
+/*
+ * Host work done while the PN532 is busy on the RF side. Commands that would change what the
+ * phone is being served (set_config:, clear_ndef:) are only recorded while a session is open
+ * and carried out when emulate() returns; the generated file is frozen at select.
+ */
+void MyCard::housekeeping(){
+    BENCH_BEGIN(BENCH_HOUSEKEEPING);
+    while(readCommand()) {
+    }
+    if(sessionOpen){
+        syncTime();
+    }
+    BENCH_END(BENCH_HOUSEKEEPING);
+}
+
+/*
+ * Waits for the PN532 response in READER_POLL_SLICE ms slices and serves the host in between,
+ * so serial bytes never wait for the RF exchange. Relies on readResponse() returning
+ * PN532_TIMEOUT without touching the bus while the PN532 is not ready (SPI and I2C).
+ * @param hostTime time spent on the host is added here
+ */
+int16_t MyCard::pollResponse(uint8_t* buf, uint8_t length, uint16_t timeout, unsigned long* hostTime){
+    unsigned long start = millis();
+    while(true){
+        unsigned long busy = millis();
+        housekeeping();
+        *hostTime += millis() - busy;
+        wdt_reset();
+        int16_t status = hal.readResponse(buf, length, READER_POLL_SLICE);
+        if(status != PN532_TIMEOUT || millis() - start >= timeout){
+            return status;
+        }
+    }
+}
+
+/*
+ * TgGetData split in two: the host is served while the PN532 waits for the next C-APDU.
+ * Only the phone's NFC stack answers at protocol speed and teaches readerTimeout; once the app
+ * selected its application the gaps include its user, and the configured bound is waited,
+ * never less than APP_READER_TIMEOUT_MIN.
+ * @return length of the C-APDU, < 0 on error
+ */
+int16_t MyCard::receiveCommand(uint8_t* buf, uint8_t length){
+    unsigned long start = millis();
+    unsigned long hostTime = 0;
+    uint16_t timeout = session.appSelected ? max(config.readerTimeout, APP_READER_TIMEOUT_MIN) : readerTimeout.timeout();
+    timeout = min((unsigned long)timeout, sessionRemaining());
+    buf[0] = PN532_COMMAND_TGGETDATA;
+    if(hal.writeCommand(buf, 1)){
+        diagnostics.readerErrors++;
+        return -1;
+    }
+    int16_t status = pollResponse(buf, length, timeout, &hostTime);
+    if(status == PN532_TIMEOUT){
+        diagnostics.readerTimeouts++;
+        // TgGetData is still pending in the PN532 and would swallow the inRelease: give it time
+        // to end on its own (field gone, or a late C-APDU that is dropped)
+        if(pollResponse(buf, length, READER_DRAIN_TIMEOUT, &hostTime) == PN532_TIMEOUT){
+            host.println("log: tgGetData still pending;");
+        }
+        return status;
+    } else if(status <= 0){
+        diagnostics.readerErrors++;
+        return status;
+    }
+    if(!session.appSelected){
+        // the host time is ours, not the reader's
+        readerTimeout.observe(millis() - start - hostTime);
+    }
+    if(buf[0] != 0){
+        DMSG("tgGetData status is not ok\n");
+        return -5;
+    }
+    memmove(buf, buf + 1, status - 1);
+    return status - 1;
+}
+
+// TgSetData split in two, the response is sent from its own buffer while the host is served
+bool MyCard::sendResponse(const uint8_t* buf, uint8_t length){
+    uint8_t header[] = { PN532_COMMAND_TGSETDATA };
+    if(hal.writeCommand(header, sizeof(header), buf, length)){
+        return false;
+    }
+    unsigned long hostTime = 0;
+    uint8_t status[2];
+    if(pollResponse(status, sizeof(status), PN532_SETDATA_TIMEOUT, &hostTime) < 0){
+        return false;
+    }
+    return status[0] == 0;
+}
+
+// starts the shadow file from the file currently served
+void MyCard::loadShadow(){
+    if(ndefWritten){
+        memcpy(ndefShadow, ndef_file, NDEF_MAX_LENGTH);
+    } else if(ndefGenerated){
+        // generateNdef() keeps the file within NDEF_MAX_LENGTH, the rest is zeroed
+        if(!ndefFrozen){
+            freezeNdef();
+        }
+        readGeneratedNdef(ndefShadow, 0, NDEF_MAX_LENGTH);
+    } else if(ndefFileP != 0){
+        // setNdefFile_P() rejects files larger than NDEF_MAX_LENGTH
+        uint16_t length = (pgm_read_byte(ndefFileP) << 8) + pgm_read_byte(ndefFileP + 1) + 2;
+        memcpy_P(ndefShadow, ndefFileP, length);
+    } else {
+        memcpy(ndefShadow, ndef_file, NDEF_MAX_LENGTH);
+    }
+}
+
+/*
+ * Replaces the ndef file with the shadow file written during the session, persists it and calls
+ * updateNdefCallback once. Writers set NLEN to 0 while updating and restore it last,
+ * so a session that ended halfway leaves NLEN at 0 and is dropped.
+ * The flash and generated files stay set and come back with clearNdef().
+ */
+void MyCard::commitShadow(){
+    shadowDirty = false;
+    uint16_t length = (ndefShadow[0] << 8) + ndefShadow[1];
+    if(length == 0 || length > NDEF_MAX_LENGTH - 2){
+        DMSG("incomplete ndef write - dropped\n");
+        return;
+    }
+    memcpy(ndef_file, ndefShadow, length + 2);
+    ndefWritten = true;
+    ndefUnsaved = !saveNdef();
+    if(ndefUnsaved){
+        host.println("log: ndef file not saved;");
+    }
+    tagWrittenByInitiator = true;
+    if(updateNdefCallback != 0){
+        updateNdefCallback(ndef_file + 2, length);
+    }
+}
+
+
+int MyCard::ndefAddress(){
+    return configAddress + 2 * sizeof(DeviceConfig);
+}
+
+// restores the file a phone wrote before the last reset, if its crc holds
+void MyCard::loadNdef(){
+    uint8_t nlen[2];
+    eepromRead(ndefAddress() + 2, nlen, sizeof(nlen));
+    uint16_t length = (nlen[0] << 8) + nlen[1];
+    if(length == 0 || length > NDEF_MAX_LENGTH - 2){
+        return;
+    }
+    uint16_t crc;
+    eepromRead(ndefAddress(), &crc, sizeof(crc));
+    eepromRead(ndefAddress() + 2, ndefShadow, length + 2);
+    if(crc != crc16(ndefShadow, length + 2)){
+        host.println("log: stored ndef file corrupt;");
+        return;
+    }
+    memcpy(ndef_file, ndefShadow, length + 2);
+    ndefWritten = true;
+}
+
+// file first, crc last: a write cut short by a reset fails the crc and is dropped at boot
+bool MyCard::saveNdef(){
+    uint16_t length = (ndef_file[0] << 8) + ndef_file[1] + 2;
+    uint16_t crc = crc16(ndef_file, length);
+    return eepromUpdate(ndefAddress() + 2, ndef_file, length) && eepromUpdate(ndefAddress(), &crc, sizeof(crc));
+}
+
+// clear_ndef: and its answer
+void MyCard::commitClearNdef(){
+    clearPending = false;
+    if(clearNdef()){
+        host.println(SERIAL_COMMAND_CLEAR_NDEF SERIAL_RESPONSE_OK);
+    } else {
+        host.println(SERIAL_COMMAND_CLEAR_NDEF SERIAL_RESPONSE_ERROR);
+    }
+}
+
+bool MyCard::clearNdef(){
+    ndefWritten = false;
+    ndefUnsaved = false;
+    invalidateNdef();
+    uint16_t nlen = 0; // NLEN 0 is never loaded
+    return eepromUpdate(ndefAddress() + 2, &nlen, sizeof(nlen));
+}
 
 void MyCard::setResponse(responseCommand cmd, uint8_t* buf, uint8_t* sendlen, uint8_t sendlenOffset){
+    BENCH_BEGIN(BENCH_SET_RESPONSE);
     switch(cmd){
         case COMMAND_COMPLETE:
             buf[0] = R_APDU_SW1_COMMAND_COMPLETE;
@@ -500,9 +1188,9 @@ void MyCard::setResponse(responseCommand cmd, uint8_t* buf, uint8_t* sendlen, ui
         case PRIV_APPLICATION_SELECTED:
             buf[0] = R_SW1_PRIV_APP_SELECTED;
             buf[1] = R_SW2_PRIV_APP_SELECTED;
-            memcpy(buf+2, cardId, 9);
+            memcpy(buf+2, config.id, 9);
             memcpy(buf + 2 + 8, ",", 2);
-            memcpy(buf + 2 + 8 + 1, secretKey, 11);
+            memcpy(buf + 2 + 8 + 1, config.secretKey, 11);
             /*for (int y = 0; y < sizeof(cardId); y++) {
                 buf[y + 2] = (uint8_t)cardId[y];
             }
@@ -510,7 +1198,7 @@ void MyCard::setResponse(responseCommand cmd, uint8_t* buf, uint8_t* sendlen, ui
             for (int z = 0; z < sizeof(secretKey); z++) {
             	buf[z + 2 + 9] = (uint8_t)secretKey[z];
             }*/
-            *sendlen = 2 + sizeof(cardId) + sizeof(secretKey)- 1;
+            *sendlen = 2 + sizeof(config.id) + sizeof(config.secretKey)- 1;
         	break;
         case STATUS_WAITING:
             buf[0] = R_SW1_STATUS_WAITING;
@@ -520,7 +1208,7 @@ void MyCard::setResponse(responseCommand cmd, uint8_t* buf, uint8_t* sendlen, ui
         case STATUS_RECHARGED:
             buf[0] = R_SW1_STATUS_RECHARGED;
             buf[1] = R_SW2_STATUS_RECHARGED;
-            memcpy(buf + 2, values, 27);
+            memcpy(buf + 2, session.values, 27);
             /*for (int y = 0; y < sizeof(amountBuf); y++) {
                 buf[y + 2] = (uint8_t)amountBuf[y];
             }
@@ -534,7 +1222,7 @@ void MyCard::setResponse(responseCommand cmd, uint8_t* buf, uint8_t* sendlen, ui
         case STATUS_PURCHASE:
             buf[0] = R_SW1_STATUS_PURCHASE;
             buf[1] = R_SW2_STATUS_PURCHASE;
-            memcpy(buf + 2, values, 27);
+            memcpy(buf + 2, session.values, 27);
             /*for (int y = 0; y < sizeof(amountBuf); y++) {
                 buf[y + 2] = (uint8_t)amountBuf[y];
             }
@@ -555,8 +1243,13 @@ void MyCard::setResponse(responseCommand cmd, uint8_t* buf, uint8_t* sendlen, ui
             buf[1] = R_SW2_ERROR_AUTH;
             *sendlen= 2;
             break;
+        case WRONG_LENGTH:
+            buf[0] = R_APDU_SW1_WRONG_LENGTH;
+            buf[1] = R_APDU_SW2_WRONG_LENGTH;
+            *sendlen= 2;
+            break;
     }
-
+    BENCH_END(BENCH_SET_RESPONSE);
 }
 
 //void MyCard::checkSerial() {
@@ -12,6 +12,7 @@
 #define __MYCARD_H__
 
 #include <MPN532.h>
+#include "NfcConfig.h"
 
 #define C_APDU_CLA   0
 #define C_APDU_INS   1 // instruction
@@ -38,6 +39,9 @@
 
 #define R_APDU_SW1_END_OF_FILE_BEFORE_REACHED_LE_BYTES 0x62
 #define R_APDU_SW2_END_OF_FILE_BEFORE_REACHED_LE_BYTES 0x82
+
+#define R_APDU_SW1_WRONG_LENGTH 0x67
+#define R_APDU_SW2_WRONG_LENGTH 0x00
 #define R_PRIV_ADDRESS_BYTE1 0xAA
 #define R_PRIV_ADDRESS_BYTE2 0xAA
 #define R_SW1_ERROR_AUTH 0xB1
@@ -72,36 +76,196 @@
 #define SERIAL_COMMAND_GET_TIME "get_time:"
 #define SERIAL_COMMAND_SET_TIME "set_time:"
 #define SERIAL_COMMAND_GET_DATE "get_date:"
+#define SERIAL_COMMAND_GET_DIAG "get_diag:"
+#define SERIAL_COMMAND_SET_PRICES "set_prices:"
+#define SERIAL_COMMAND_SET_CONFIG "set_config:"
+#define SERIAL_COMMAND_GET_CONFIG "get_config:"
+#define SERIAL_COMMAND_CLEAR_NDEF "clear_ndef:"
 #define SERIAL_COMMAND_LOG "log:";
 #define SERIAL_RESPONSE_OK "ok;"
 #define SERIAL_RESPONSE_ERROR "err;"
 #define SERIAL_VALUE_REQUEST "req;"
+#define SERIAL_TIME_LENGTH 13 // seconds since 1970 followed by 3 digits of milliseconds
 #define SERIAL_COMMAND_START "<"
 #define SERIAL_COMMAND_END ">"
 
 
 #define NDEF_MAX_LENGTH 128  // altough ndef can handle up to 0xfffe in size, arduino cannot.
+#define APDU_BUFFER_SIZE 128 // C-APDU and R-APDU buffers of emulate()
+#define C_APDU_MAX_DATA (APDU_BUFFER_SIZE - 1 - C_APDU_DATA) // largest MLc: PN532 status byte and header go first
+#define NDEF_STORE_SIZE (2 + NDEF_MAX_LENGTH) // crc and the ndef file written by a phone, after the config slots
+#define CONFIG_STORE_SIZE (2 * sizeof(DeviceConfig) + NDEF_STORE_SIZE) // EEPROM bytes used by one reader
+#define NDEF_PRICES_LENGTH 25 // price list shown in the generated ndef file, terminator included
+
+#define SESSION_BUDGET 30000UL        // ms a phone may stay in one session, default of the config
+#define HOST_TIMEOUT_MIN 200          // bounds of the learned wait for a host answer, ms
+#define HOST_TIMEOUT_MAX 5000         // default of the config
+#define READER_TIMEOUT_MIN 1000       // bounds of the learned wait for the next C-APDU, ms
+#define READER_TIMEOUT_MAX 3000       // default of the config
+#define APP_READER_TIMEOUT_MIN 2000   // ms, the app waits for its user between two commands
+#define READER_DRAIN_TIMEOUT 1000     // ms a timed out TgGetData is given to end before inRelease
+#define TIMEOUT_LIMIT 6000            // ms, configurable bound: below the watchdog period, and
+                                      // average + 4 * deviation of AdaptiveTimeout fits an int
+#define PN532_SETDATA_TIMEOUT 1000
+#define READER_POLL_SLICE 2           // ms the PN532 is waited for between two serial drains
+#define STATUS_POLL_DELAY 50          // ms, throttles the status polling of the app
+#define WATCHDOG_TIMEOUT WDTO_8S      // longer than the longest blocking PN532 call
+#define TG_INIT_TIMEOUT_MAX 6000      // ms, tgInitAsTarget cannot kick the watchdog while it waits
+
+#define TIME_SYNC_INTERVAL 3600000UL    // ms between two get_time requests to the host
+#define TIME_SYNC_RETRY 60000UL         // ms between requests while the host never answered
+#define TIME_SYNC_TIMEOUT 200           // ms, later set_time answers only step the clock
+#define TIME_DRIFT_MIN_INTERVAL 60000UL // shorter sync intervals are too noisy to measure drift
+#define TIME_DRIFT_MAX_ERROR 10000      // ms, a larger error is a clock step, not drift
+#define TIME_DRIFT_MAX_PPM 20000
 typedef enum {COMMAND_COMPLETE, TAG_NOT_FOUND, FUNCTION_NOT_SUPPORTED, MEMORY_FAILURE,
 	END_OF_FILE_BEFORE_REACHED_LE_BYTES, PRIV_APPLICATION_SELECTED, STATUS_WAITING, STATUS_RECHARGED,
-	STATUS_PURCHASE, STATUS_DATA_UPDATED, AUTH_ERROR} responseCommand;
+	STATUS_PURCHASE, STATUS_DATA_UPDATED, AUTH_ERROR, WRONG_LENGTH} responseCommand;
 
 typedef enum {WAITING, CONNECTED, AUTHENTICATED, LOGGED, WAITING_SERIAL,
 	RECHARGE, PURCHASE, DISCONNECTED, ERROR_AUTH } CardState;
 
 typedef enum {LOGIN, LOGOUT, PURCHASE_TRANSACTION, RECHARGE_TRANSACTION, NOTHING} Event;
 
+typedef enum {S_DISCONNECTED, S_CONNECTED} SerialState;
+
+typedef enum {REPLY_OK, REPLY_ERROR, REPLY_TIMEOUT} HostReply;
+
+/*
+ * Timeout learned from observed latencies: smoothed average plus four times the smoothed
+ * deviation, as TCP does for its retransmission timer.
+ */
+static_assert(5L * TIMEOUT_LIMIT <= 32767, "AdaptiveTimeout arithmetic overflows an int");
+
+struct AdaptiveTimeout {
+    uint16_t average;   // ms
+    uint16_t deviation; // ms
+    uint16_t minimum;
+    uint16_t maximum;
+
+    AdaptiveTimeout(uint16_t minimum, uint16_t maximum) : average(maximum / 2), deviation(maximum / 8),
+        minimum(minimum), maximum(maximum) { }
+
+    void observe(unsigned long latency){
+        int16_t sample = min(latency, (unsigned long)maximum);
+        int16_t error = sample - (int16_t)average;
+        average += error / 8;
+        deviation += ((error < 0 ? -error : error) - (int16_t)deviation) / 4;
+    }
+
+    uint16_t timeout() const {
+        return constrain(average + 4 * deviation, minimum, maximum);
+    }
+
+    // no answer in time: double the timeout as TCP does, answers that come pull it back down
+    void backoff(){
+        uint16_t doubled = min(2UL * timeout(), (unsigned long)maximum);
+        average = doubled / 2;
+        deviation = doubled / 8;
+    }
+};
+
+// Counters reported by get_diag:
+struct Diagnostics {
+    uint16_t sessions;
+    uint16_t hostTimeouts;
+    uint16_t readerTimeouts;
+    uint16_t readerErrors;
+    uint16_t budgetOverruns;
+};
+
+// Serial link to the host and its command parser, one per reader
+struct HostLink {
+    SerialState state;
+    String inputCommand;        // a string to hold incoming data
+    String inputValue;
+    boolean valueIn;
+    boolean commandComplete;    // whether the string is complete
+    const char* awaited;        // command whose ok/err answer waitHost() waits for, 0 = none
+    HostReply reply;
+};
+
+// State of one emulation session, reset at the start of emulate()
+struct Session {
+    CardState cardState;
+    Event eventType;
+    String userId;
+    String userCredit;
+    String controlKeyReceived;
+    boolean loggedin;
+    boolean appSelected;        // the app selected its private application, gaps include its user
+    boolean connectedToBackend;
+    long transactionId;         // last id handed out by MyCard::nextTransactionId
+    char values[28];
+    char transIdBuf[9];
+};
+
+struct NdefWindow;
 
 class MyCard{
     
 public:
-    MyCard(PN532Interface &interface) : pn532(interface), uidPtr(0), tagWrittenByInitiator(false), tagWriteable(true), updateNdefCallback(0) { }
+    /*
+     * @param host serial link to the host of this reader, every reader needs its own
+     */
+    MyCard(PN532Interface &interface, Stream &host = Serial) : pn532(interface), hal(interface), host(host), led(7), epoch(0), epochMillis(0), driftPpm(0),
+        clockSynced(false), timeRequested(false), lastTimeRequest(0), sessionStart(0), sessionOpen(false), clearPending(false),
+        connectTimeout(HOST_TIMEOUT_MIN, HOST_TIMEOUT_MAX), dataTimeout(HOST_TIMEOUT_MIN, HOST_TIMEOUT_MAX), readerTimeout(READER_TIMEOUT_MIN, READER_TIMEOUT_MAX),
+        shadowDirty(false), shadowLoaded(false), ndefWritten(false), ndefUnsaved(false), ndefFileP(0), ndefGenerated(false), ndefStale(true), ndefFrozen(false), frozenOnline(false), generatedLength(0), uidPtr(config.uid), tagWrittenByInitiator(false), tagWriteable(true), updateNdefCallback(0) {
+        link.state = S_DISCONNECTED;
+        link.valueIn = false;
+        link.commandComplete = false;
+        link.awaited = 0;
+        session.cardState = WAITING;
+        session.transactionId = 0;
+        memset(&diagnostics, 0, sizeof(diagnostics));
+        resetConfig();
+    }
+
+
+    /*
+     * Loads the config and the ndef file last written by a phone from EEPROM (defaults when
+     * there is none) and starts the PN532.
+     * @param configAddress EEPROM address of this reader's CONFIG_STORE_SIZE bytes, see NfcConfig.h
+     */
+    bool init(int configAddress = CONFIG_ADDRESS);
 
+    /*
+     * Serves one phone session.
+     * @param tgInitAsTargetTimeout ms to wait for a phone, 0 or more than TG_INIT_TIMEOUT_MAX
+     *                              waits TG_INIT_TIMEOUT_MAX so the watchdog never fires
+     */
+    bool emulate(const uint16_t tgInitAsTargetTimeout);
+
+    // transaction ids are unique across all readers of the board
+    static long nextTransactionId();
+
+    /*
+     * Device clock, disciplined by set_time from the host.
+     * @return false while the clock was never set
+     */
+    bool getTime(uint32_t* seconds, uint16_t* milliseconds);
 
-    bool init();
+    const Diagnostics& getDiagnostics(){
+        return diagnostics;
+    }
 
-    bool emulate(const uint16_t tgInitAsTargetTimeout = 0);
+    // led lit while the host is connected, set it before init()
+    void setLed(uint8_t pin){
+        led = pin;
+    }
     
-    void setId(char id[]);
+    // id and name change the ram config only, saveConfig() makes them persistent
+    void setId(const char* id);
+
+    void setName(const char* name);
+
+    /*
+     * Writes the ram config to the EEPROM slot not holding the current one. Never call it
+     * while emulate() serves a phone.
+     * @return false when nothing valid could be written
+     */
+    bool saveConfig();
 
     /*
      * @param uid pointer to byte array of length 3 (uid is 4 bytes - first byte is fixed) or zero for uid
@@ -109,7 +273,39 @@ public:
     void setUid(uint8_t* uid = 0);
     
     void setNdefFile(const uint8_t* ndef, const int16_t ndefLength);
+
+    /*
+     * @param ndef pointer to a PROGMEM ndef file (2 bytes length + message), see NDEF_MIME_FILE.
+     *             The file is served straight from flash, nothing is copied to ram.
+     */
+    void setNdefFile_P(const uint8_t* ndef);
+
+    /*
+     * Serve an ndef file generated on demand from the machine state (name, id, prices, host connection).
+     * The message holds the record set with setNdefFile_P (if any) followed by a text record.
+     * Selecting the file freezes the connection state and the prices for the session, each
+     * READ_BINARY then builds only its window. A file written by a phone is served instead
+     * until clearNdef().
+     */
+    void setNdefGenerated(bool generated){
+        ndefGenerated = generated;
+        invalidateNdef();
+    }
+
+    /*
+     * Marks the generated ndef file as changed, call it whenever the machine state changes.
+     * A session that already selected the file keeps serving what it froze.
+     */
+    void invalidateNdef();
+
+    /*
+     * Forgets the ndef file written by a phone, in ram and EEPROM. A written file is served
+     * instead of the generated, flash or ram one until then (host command clear_ndef:).
+     * @return false when the EEPROM copy could not be cleared, it comes back after a reset
+     */
+    bool clearNdef();
     
+    // ram file only (setNdefFile)
     void getContent(uint8_t** buf, uint16_t* length){
         *buf = ndef_file + 2; // first 2 bytes = length
         *length = (ndef_file[0] << 8) + ndef_file[1];
@@ -131,19 +327,85 @@ public:
         return NDEF_MAX_LENGTH;
     }
     
+    // func is called once per session, after the initiator wrote a new ndef file
     void attach(void (*func)(uint8_t *buf, uint16_t length)) {
         updateNdefCallback = func;
     };
 
     
 private:
+    static long lastTransactionId; // shared by all readers, see nextTransactionId
     PN532 pn532;
+    PN532Interface& hal;
+    Stream& host;
+    HostLink link;
+    Session session;
+    uint8_t led;
+    DeviceConfig config;
+    int configAddress;
+    uint8_t configSlot;         // slot the ram config was loaded from or saved to
+    DeviceConfig pendingConfig; // set_config: received during a session, applied when it ends
+    uint8_t configPending = 0;  // set_config: commands merged into pendingConfig, not answered yet
+    char prices[NDEF_PRICES_LENGTH] = "";
+    uint32_t epoch;             // host time at the last sync, seconds since 1970
+    unsigned long epochMillis;  // millis() at the last sync
+    long driftPpm;              // measured drift of the local oscillator
+    bool clockSynced;
+    bool timeRequested;         // get_time:req; sent, waiting for set_time
+    unsigned long lastTimeRequest;
+    char currentDate[9];
+    unsigned long sessionStart;
+    bool sessionOpen;           // a phone is being served, state changes wait until it leaves
+    bool clearPending;          // clear_ndef: received during a session
+    AdaptiveTimeout connectTimeout;     // connection:req, answered by the host itself
+    AdaptiveTimeout dataTimeout;        // set_data:, needs a round trip to the backend
+    AdaptiveTimeout readerTimeout;      // turnaround of the phone's NFC stack, app sessions excluded
+    Diagnostics diagnostics;
     uint8_t ndef_file[NDEF_MAX_LENGTH];
+    uint8_t ndefShadow[NDEF_MAX_LENGTH]; // UPDATE_BINARY target, copied to ndef_file when the session ends
+    bool shadowDirty;
+    bool shadowLoaded;          // ndefShadow was started by UPDATE_BINARY in this session
+    bool ndefWritten;           // ndef_file holds what a phone wrote, served before anything else
+    bool ndefUnsaved;           // the EEPROM refused ndef_file, saved again when the next session ends
+    const uint8_t* ndefFileP;
+    bool ndefGenerated;
+    bool ndefStale;             // machine state changed since the last freezeNdef()
+    bool ndefFrozen;            // this session serves the generated file from the frozen inputs
+    bool frozenOnline;          // inputs of the generated file, copied by freezeNdef()
+    char frozenPrices[NDEF_PRICES_LENGTH] = "";
+    uint16_t generatedLength;   // length of the generated file for the frozen inputs
     uint8_t* uidPtr;
     bool tagWrittenByInitiator;
     bool tagWriteable;
     void (*updateNdefCallback)(uint8_t *ndef, uint16_t length);
     
+    boolean readCommand();
+    void housekeeping();
+    HostReply waitHost(const char* command, AdaptiveTimeout* timeout);
+    unsigned long sessionRemaining();
+    int16_t pollResponse(uint8_t* buf, uint8_t length, uint16_t timeout, unsigned long* hostTime);
+    int16_t receiveCommand(uint8_t* buf, uint8_t length);
+    bool sendResponse(const uint8_t* buf, uint8_t length);
+    void setCurrentDate(String input);
+    void setTime(String value);
+    void syncTime();
+    void formatTime(char* buf);
+    void setValues(const char* value, uint8_t length);
+    void resetConfig();
+    bool loadConfig();
+    void applyConfig();
+    void commitConfig();
+    void commitClearNdef();
+    bool parseConfig(char* value, DeviceConfig* parsed);
+    void printConfig();
+    void freezeNdef();
+    void readGeneratedNdef(uint8_t* buf, uint16_t offset, uint8_t length);
+    void generateNdef(NdefWindow* window);
+    void loadShadow();
+    void commitShadow();
+    int ndefAddress();
+    void loadNdef();
+    bool saveNdef();
     void setResponse(responseCommand cmd, uint8_t* buf, uint8_t* sendlen, uint8_t sendlenOffset = 0);
     void sendRequest(Event event);
 };
@@ -0,0 +1,36 @@
+/**************************************************************************/
+/*!
+ @file     NfcBench.h
+ @license  BSD
+
+ Cycle markers for the simavr benchmark (see bench/). Built with
+ -DNFC_BENCH every marker is a single `out` to GPIOR0 (begin), GPIOR1
+ (end) or GPIOR2 (pause/resume), which bench/nfcbench timestamps with the
+ simulator cycle counter. Delays and waits for the host inside a marked
+ handler sit between BENCH_PAUSE and BENCH_RESUME, so only the handler's
+ own work is counted. Without NFC_BENCH the markers compile to nothing.
+ */
+/**************************************************************************/
+
+#ifndef __NFC_BENCH_H__
+#define __NFC_BENCH_H__
+
+// APDU handlers are marked with their INS byte, everything else uses ids below 0x10
+#define BENCH_READ_COMMAND  0x01 // serial parser, readCommand()
+#define BENCH_HOUSEKEEPING  0x02 // host work overlapped with the RF exchange
+#define BENCH_SET_RESPONSE  0x03
+
+#ifdef NFC_BENCH
+#include <avr/io.h>
+#define BENCH_BEGIN(id) (GPIOR0 = (id))
+#define BENCH_END(id)   (GPIOR1 = (id))
+#define BENCH_PAUSE(id)  (GPIOR2 = (id)) // the harness toggles pause and resume on the same id
+#define BENCH_RESUME(id) (GPIOR2 = (id))
+#else
+#define BENCH_BEGIN(id)
+#define BENCH_END(id)
+#define BENCH_PAUSE(id)
+#define BENCH_RESUME(id)
+#endif
+
+#endif
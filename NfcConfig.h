@@ -0,0 +1,86 @@
+/**************************************************************************/
+/*!
+ @file     NfcConfig.h
+ @license  BSD
+
+ Persistent identity and settings of a reader.
+
+ The block is kept in EEPROM twice, in two slots written alternately. Each
+ slot carries a sequence number and a CRC, so a write cut short by a reset
+ leaves the other slot intact: at boot the newest valid slot is copied to
+ ram once and nothing else is read from EEPROM. The host changes it with
+ set_config: (see MyCard), a fleet is provisioned without reflashing.
+
+ The NDEF file last written by a phone follows the two slots, behind its
+ own CRC (NDEF_STORE_SIZE bytes, see NfcAdapter.h).
+ */
+/**************************************************************************/
+
+#ifndef __NFC_CONFIG_H__
+#define __NFC_CONFIG_H__
+
+#include <Arduino.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+
+#define CONFIG_VERSION 1    // bump when the layout changes, older blocks fall back to the defaults
+#define CONFIG_ADDRESS 0    // first of the two slots, every reader needs its own CONFIG_STORE_SIZE bytes
+
+#define CONFIG_ID_LENGTH 8  // the app expects fixed width id and key
+#define CONFIG_KEY_LENGTH 10
+#define CONFIG_MAX_READ 0x7E // R-APDU buffer less the status word
+
+struct DeviceConfig {
+    uint8_t version;
+    uint8_t sequence;       // the newer of the two slots wins, wraps around
+    char id[CONFIG_ID_LENGTH + 1];
+    char name[17];
+    uint8_t uid[3];         // NFCID1 bytes after the fixed first one
+    uint8_t secretKey[CONFIG_KEY_LENGTH + 1];
+    uint8_t maxRead;        // capability container MLe
+    uint8_t maxWrite;       // capability container MLc
+    uint8_t locked;         // 1 = ndef file read only
+    uint16_t sessionBudget; // ms
+    uint16_t hostTimeout;   // upper bound of the learned host timeout, ms
+    uint16_t readerTimeout; // upper bound of the learned reader timeout, ms
+    uint16_t crc;           // of everything above
+};
+
+inline uint16_t crc16(const uint8_t* data, uint16_t length){
+    uint16_t crc = 0xFFFF;
+    for(uint16_t i = 0; i < length; i++){
+        crc = _crc16_update(crc, data[i]);
+    }
+    return crc;
+}
+
+inline void eepromRead(int address, void* data, uint16_t length){
+    eeprom_read_block(data, (const void*)(uintptr_t)address, length);
+}
+
+// avr-libc directly: EEPROMex caps the writes per boot and reports on Serial, the host link
+// @return false when the EEPROM did not keep what was written
+inline bool eepromUpdate(int address, const void* data, uint16_t length){
+    eeprom_update_block(data, (void*)(uintptr_t)address, length);
+    for(uint16_t i = 0; i < length; i++){
+        if(eeprom_read_byte((const uint8_t*)(uintptr_t)address + i) != ((const uint8_t*)data)[i]){
+            return false;
+        }
+    }
+    return true;
+}
+
+inline uint16_t configCrc(const DeviceConfig* config){
+    return crc16((const uint8_t*)config, offsetof(DeviceConfig, crc));
+}
+
+inline bool configValid(const DeviceConfig* config){
+    return config->version == CONFIG_VERSION && config->crc == configCrc(config);
+}
+
+// true when sequence a was written after b
+inline bool configNewer(uint8_t a, uint8_t b){
+    return (int8_t)(a - b) > 0;
+}
+
+#endif
@@ -1,8 +1,8 @@
 #include <SPI.h>
 #include "MPN532_SPI.h"
-#include "MNdefMessage.h"
 #include <EEPROMex.h>
 #include "NfcAdapter.h"
+#include "NdefFile.h"
 
 #define SERIAL_COMMAND_CONNECTION "connection:"
 #define SERIAL_COMMAND_RECHARGE "recharge:"
@@ -14,38 +14,23 @@
 #define SERIAL_RESPONSE_ERROR "err;"
 #define SERIAL_VALUE_REQUEST "req;"
 
+#define EMULATE_TIMEOUT 5000 // ms to wait for a phone before loop() runs again
+
 PN532_SPI pn532spi(SPI, 10);
 MyCard nfc(pn532spi);
 
-uint8_t ndefBuf[120];
-NdefMessage message;
-int messageSize;
-int idAddress = 0;
-char id[8] = "";
-
-uint8_t uid[3] = { 0x12, 0x34, 0x56 };
+NDEF_MIME_FILE(ndefFile, "application/coffeeap", "ciao");
 
 void setup() {
 	pinMode(53, OUTPUT);
 	Serial.begin(115200);
 
-	delay(1000);
-    nfc.setId("00005678");
-
-    message = NdefMessage();
-    message.addMimeMediaRecord("application/coffeeap", "ciao");
-    messageSize = message.getEncodedSize();
-    if (messageSize > sizeof(ndefBuf)) {
-        while (1) { }
-    }
-
-    message.encode(ndefBuf);
-
     // comment out this command for no ndef message
-    nfc.setNdefFile(ndefBuf, messageSize);
+    nfc.setNdefFile_P(ndefFile.data);
+    // append a text record with the live machine state to the message
+    nfc.setNdefGenerated(true);
 
-    // uid must be 3 bytes!
-    nfc.setUid(uid);
+    // id, name, uid, key and timeouts come from EEPROM, the host sets them with set_config:
     nfc.init();
 }
 
@@ -54,6 +39,6 @@ void setup() {
 void loop() {
 
 	Serial.println("log:main loop;");
-    nfc.emulate(5000);
+    nfc.emulate(EMULATE_TIMEOUT);
     Serial.println("log:fine emulazione;");
 }
@@ -0,0 +1,550 @@
+/**************************************************************************/
+/*!
+ @file     nfcbench.c
+ @license  BSD
+
+ Runs the NfcMega2 firmware (built with -DNFC_BENCH) on a simulated
+ ATmega2560 and reports exact cycle counts between the NfcBench.h markers.
+ Cycles between BENCH_PAUSE and BENCH_RESUME (delays, waits for the host)
+ are left out of the marker they belong to.
+
+ A fake PN532 sits on the SPI bus (SS = Arduino pin 10, PB4) and a fake
+ host on UART0. Both follow a scenario script, one step per line:
+
+   field               next TgInitAsTarget succeeds (a phone is presented)
+   apdu <hex>          answer the next TgGetData with this C-APDU
+   expect <text>       wait until the firmware prints <text> on the serial
+   host <text>         send <text> to the firmware serial, \n for a newline
+   # ...               comment
+
+ The run ends when the script is done and the firmware asks the PN532
+ for more, or after the cycle limit. With -r the PN532 holds back TgGetData
+ and TgSetData answers for the given RF time, so host work the firmware
+ overlaps with the exchange shows up as a shorter total.
+
+ usage: nfcbench [-c results.csv] [-l max_seconds] [-r rf_us] firmware.elf scenario.txt
+ */
+/**************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_io.h"
+#include "sim_cycle_timers.h"
+#include "avr_spi.h"
+#include "avr_uart.h"
+#include "avr_ioport.h"
+
+#define F_CPU 16000000UL
+
+#define GPIOR0_ADDR 0x3E // BENCH_BEGIN
+#define GPIOR1_ADDR 0x4A // BENCH_END
+#define GPIOR2_ADDR 0x4B // BENCH_PAUSE / BENCH_RESUME
+
+#define PN532_SS_PORT 'B'
+#define PN532_SS_PIN  4
+
+#define PN532_SPI_DATA_WRITE  0x01
+#define PN532_SPI_STATUS_READ 0x02
+#define PN532_SPI_DATA_READ   0x03
+
+#define PN532_HOSTTOPN532 0xD4
+#define PN532_PN532TOHOST 0xD5
+
+#define PN532_COMMAND_GETFIRMWAREVERSION 0x02
+#define PN532_COMMAND_SAMCONFIGURATION   0x14
+#define PN532_COMMAND_INRELEASE          0x52
+#define PN532_COMMAND_TGINITASTARGET     0x8C
+#define PN532_COMMAND_TGGETDATA          0x86
+#define PN532_COMMAND_TGSETDATA          0x8E
+
+#define UART_BYTE_CYCLES (F_CPU / 11520) // 115200 baud, 10 bits per byte
+
+#define MAX_STEPS 256
+#define MAX_LINE 300
+#define FRAME_MAX 300
+#define OUTPUT_MAX 4096
+
+typedef enum { STEP_FIELD, STEP_APDU, STEP_EXPECT, STEP_HOST } step_kind;
+
+typedef struct {
+    step_kind kind;
+    uint8_t data[MAX_LINE];
+    int len;
+} step_t;
+
+typedef struct {
+    uint64_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t start;
+    uint64_t pausedAt;  // 0 = running
+    int open;
+} marker_t;
+
+typedef enum { SPI_IDLE, SPI_OP, SPI_WRITE, SPI_STATUS, SPI_READ } spi_phase;
+
+static avr_t* avr;
+static step_t steps[MAX_STEPS];
+static int stepCount;
+static int stepIdx;
+static int finished;
+
+static marker_t markers[256];
+
+static avr_irq_t* spiIn;
+static spi_phase phase = SPI_IDLE;
+static uint8_t frameIn[FRAME_MAX];
+static int frameInLen;
+static uint8_t stream[FRAME_MAX * 2]; // ACK + response frame waiting to be read
+static int streamLen;
+static int streamPos;
+static uint8_t pendingCommand; // TgGetData / TgInitAsTarget waiting for the script
+static int ackEnd;                // the ACK is always ready at once
+static uint64_t readyAt;          // cycle at which the rest of the stream is ready
+static uint64_t rfCycles;
+
+static avr_irq_t* uartIn;
+static uint8_t hostOut[OUTPUT_MAX]; // bytes queued for the firmware serial
+static int hostOutLen;
+static int hostOutPos;
+static int hostSending;
+static char serialIn[OUTPUT_MAX]; // what the firmware printed since the last expect
+static int serialInLen;
+static uint64_t apdus;
+
+static const char* markerName(int id) {
+    // ids from NfcBench.h, APDU handlers use their INS byte (NfcAdapter.h)
+    switch(id) {
+        case 0x01: return "readCommand";
+        case 0x02: return "housekeeping";
+        case 0x03: return "setResponse";
+        case 0xA4: return "SELECT_FILE";
+        case 0xB0: return "READ_BINARY";
+        case 0xD6: return "UPDATE_BINARY";
+        case 0x20: return "AUTHENTICATE";
+        case 0x30: return "LOG_IN";
+        case 0x40: return "READING_STATUS";
+        case 0x50: return "UPDATE_CREDIT";
+        default: return "unknown INS";
+    }
+}
+
+static void markerBegin(struct avr_t* avr, avr_io_addr_t addr, uint8_t v, void* param) {
+    markers[v].start = avr->cycle;
+    markers[v].pausedAt = 0;
+    markers[v].open = 1;
+}
+
+// the paused time is skipped by moving the start forward
+static void markerResume(marker_t* m, uint64_t cycle) {
+    m->start += cycle - m->pausedAt;
+    m->pausedAt = 0;
+}
+
+static void markerPause(struct avr_t* avr, avr_io_addr_t addr, uint8_t v, void* param) {
+    marker_t* m = &markers[v];
+    if(!m->open) {
+        return;
+    }
+    if(m->pausedAt == 0) {
+        m->pausedAt = avr->cycle;
+    } else {
+        markerResume(m, avr->cycle);
+    }
+}
+
+static void markerEnd(struct avr_t* avr, avr_io_addr_t addr, uint8_t v, void* param) {
+    marker_t* m = &markers[v];
+    if(!m->open) {
+        return;
+    }
+    if(m->pausedAt != 0) {
+        markerResume(m, avr->cycle);
+    }
+    uint64_t cycles = avr->cycle - m->start;
+    if(m->count == 0 || cycles < m->min) {
+        m->min = cycles;
+    }
+    if(cycles > m->max) {
+        m->max = cycles;
+    }
+    m->total += cycles;
+    m->count++;
+    m->open = 0;
+}
+
+/* ---- scenario ---- */
+
+static int hexValue(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    c = tolower(c);
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+static void loadScenario(const char* path) {
+    FILE* f = fopen(path, "r");
+    if(!f) {
+        perror(path);
+        exit(1);
+    }
+    char line[MAX_LINE];
+    int lineNo = 0;
+    while(fgets(line, sizeof(line), f)) {
+        lineNo++;
+        line[strcspn(line, "\r\n")] = 0;
+        char* p = line;
+        while(isspace((unsigned char)*p)) p++;
+        if(*p == 0 || *p == '#') {
+            continue;
+        }
+        if(stepCount == MAX_STEPS) {
+            fprintf(stderr, "%s:%d: too many steps\n", path, lineNo);
+            exit(1);
+        }
+        step_t* s = &steps[stepCount++];
+        char* arg = strchr(p, ' ');
+        if(arg) {
+            *arg++ = 0;
+        } else {
+            arg = p + strlen(p);
+        }
+        if(0 == strcmp(p, "field")) {
+            s->kind = STEP_FIELD;
+        } else if(0 == strcmp(p, "apdu")) {
+            s->kind = STEP_APDU;
+            for(int hi = -1; *arg; arg++) {
+                int v = hexValue(*arg);
+                if(v < 0) continue;
+                if(hi < 0) {
+                    hi = v;
+                } else {
+                    s->data[s->len++] = (hi << 4) | v;
+                    hi = -1;
+                }
+            }
+        } else if(0 == strcmp(p, "expect") || 0 == strcmp(p, "host")) {
+            s->kind = (p[0] == 'e') ? STEP_EXPECT : STEP_HOST;
+            for(; *arg; arg++) {
+                if(arg[0] == '\\' && arg[1] == 'n') {
+                    s->data[s->len++] = '\n';
+                    arg++;
+                } else {
+                    s->data[s->len++] = *arg;
+                }
+            }
+        } else {
+            fprintf(stderr, "%s:%d: unknown step '%s'\n", path, lineNo, p);
+            exit(1);
+        }
+    }
+    fclose(f);
+}
+
+/* ---- fake host on UART0 ---- */
+
+static avr_cycle_count_t hostSendByte(struct avr_t* avr, avr_cycle_count_t when, void* param) {
+    if(hostOutPos < hostOutLen) {
+        avr_raise_irq(uartIn, hostOut[hostOutPos++]);
+        return when + UART_BYTE_CYCLES;
+    }
+    hostOutPos = hostOutLen = 0;
+    hostSending = 0;
+    return 0;
+}
+
+static void hostSend(const uint8_t* data, int len) {
+    if(hostOutLen + len > OUTPUT_MAX) {
+        fprintf(stderr, "host output overflow\n");
+        exit(1);
+    }
+    memcpy(hostOut + hostOutLen, data, len);
+    hostOutLen += len;
+    if(!hostSending) {
+        hostSending = 1;
+        avr_cycle_timer_register(avr, UART_BYTE_CYCLES, hostSendByte, NULL);
+    }
+}
+
+static void pn532Answer(void);
+
+// runs host/expect steps until the script needs the PN532 or the firmware
+static void advanceScript(void) {
+    while(stepIdx < stepCount) {
+        step_t* s = &steps[stepIdx];
+        if(s->kind == STEP_HOST) {
+            hostSend(s->data, s->len);
+        } else if(s->kind == STEP_EXPECT) {
+            serialIn[serialInLen] = 0;
+            char* hit = strstr(serialIn, (const char*)s->data);
+            if(!hit) {
+                return;
+            }
+            // keep what came after the match for the next expect
+            int used = (hit - serialIn) + s->len;
+            memmove(serialIn, serialIn + used, serialInLen - used);
+            serialInLen -= used;
+        } else {
+            if(pendingCommand) {
+                pn532Answer();
+            }
+            return;
+        }
+        stepIdx++;
+    }
+}
+
+static void uartOutput(struct avr_irq_t* irq, uint32_t value, void* param) {
+    if(serialInLen == OUTPUT_MAX - 1) {
+        memmove(serialIn, serialIn + OUTPUT_MAX / 2, OUTPUT_MAX / 2);
+        serialInLen -= OUTPUT_MAX / 2;
+    }
+    serialIn[serialInLen++] = (char)value;
+    advanceScript();
+}
+
+/* ---- fake PN532 on SPI ---- */
+
+static void queueFrame(const uint8_t* data, int len) {
+    uint8_t* f = stream + streamLen;
+    uint8_t sum = 0;
+    f[0] = 0x00;
+    f[1] = 0x00;
+    f[2] = 0xFF;
+    f[3] = len;
+    f[4] = (uint8_t)(~len + 1);
+    for(int i = 0; i < len; i++) {
+        f[5 + i] = data[i];
+        sum += data[i];
+    }
+    f[5 + len] = (uint8_t)(~sum + 1);
+    f[6 + len] = 0x00;
+    streamLen += len + 7;
+}
+
+static void queueResponse(uint8_t command, const uint8_t* data, int len) {
+    uint8_t r[FRAME_MAX];
+    r[0] = PN532_PN532TOHOST;
+    r[1] = command + 1;
+    memcpy(r + 2, data, len);
+    queueFrame(r, len + 2);
+}
+
+// answers the TgInitAsTarget / TgGetData that was waiting for its script step
+static void pn532Answer(void) {
+    step_t* s = &steps[stepIdx];
+    if(pendingCommand == PN532_COMMAND_TGINITASTARGET && s->kind == STEP_FIELD) {
+        static const uint8_t activated[] = { 0x08, 0xE0, 0x80 }; // mode, RATS
+        queueResponse(pendingCommand, activated, sizeof(activated));
+    } else if(pendingCommand == PN532_COMMAND_TGGETDATA && s->kind == STEP_APDU) {
+        uint8_t r[MAX_LINE + 1];
+        r[0] = 0x00; // status ok
+        memcpy(r + 1, s->data, s->len);
+        queueResponse(pendingCommand, r, s->len + 1);
+        readyAt = avr->cycle + rfCycles;
+        apdus++;
+    } else {
+        return;
+    }
+    pendingCommand = 0;
+    stepIdx++;
+    advanceScript();
+}
+
+static void pn532Command(void) {
+    // 00 00 FF LEN LCS D4 CMD ... DCS 00
+    if(frameInLen < 7 || frameIn[5] != PN532_HOSTTOPN532) {
+        return;
+    }
+    static const uint8_t ack[] = { 0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00 };
+    uint8_t command = frameIn[6];
+
+    streamLen = streamPos = 0;
+    memcpy(stream, ack, sizeof(ack));
+    streamLen = ackEnd = sizeof(ack);
+    readyAt = 0;
+
+    switch(command) {
+        case PN532_COMMAND_GETFIRMWAREVERSION: {
+            static const uint8_t version[] = { 0x32, 0x01, 0x06, 0x07 };
+            queueResponse(command, version, sizeof(version));
+            break;
+        }
+        case PN532_COMMAND_TGSETDATA:
+            readyAt = avr->cycle + rfCycles;
+            // fall through
+        case PN532_COMMAND_INRELEASE: {
+            static const uint8_t ok[] = { 0x00 };
+            queueResponse(command, ok, sizeof(ok));
+            break;
+        }
+        case PN532_COMMAND_TGINITASTARGET:
+        case PN532_COMMAND_TGGETDATA:
+            if(stepIdx == stepCount) {
+                finished = 1;
+                break;
+            }
+            // the answer waits for the script, the firmware polls status until then
+            pendingCommand = command;
+            advanceScript();
+            break;
+        default:
+            queueResponse(command, NULL, 0);
+            break;
+    }
+}
+
+static int streamReady(void) {
+    return streamPos < ackEnd || (streamPos < streamLen && avr->cycle >= readyAt);
+}
+
+static void spiOutput(struct avr_irq_t* irq, uint32_t value, void* param) {
+    uint8_t reply = 0;
+    switch(phase) {
+        case SPI_IDLE:
+            break;
+        case SPI_OP:
+            if(value == PN532_SPI_DATA_WRITE) {
+                phase = SPI_WRITE;
+                frameInLen = 0;
+            } else if(value == PN532_SPI_STATUS_READ) {
+                phase = SPI_STATUS;
+            } else if(value == PN532_SPI_DATA_READ) {
+                phase = SPI_READ;
+            }
+            break;
+        case SPI_WRITE:
+            if(frameInLen < FRAME_MAX) {
+                frameIn[frameInLen++] = value;
+            }
+            break;
+        case SPI_STATUS:
+            reply = streamReady() ? 0x01 : 0x00;
+            break;
+        case SPI_READ:
+            if(streamReady()) {
+                reply = stream[streamPos++];
+            }
+            break;
+    }
+    avr_raise_irq(spiIn, reply);
+}
+
+static void spiSelect(struct avr_irq_t* irq, uint32_t value, void* param) {
+    if(value == 0) {
+        phase = SPI_OP;
+    } else {
+        if(phase == SPI_WRITE) {
+            pn532Command();
+        }
+        phase = SPI_IDLE;
+    }
+}
+
+/* ---- report ---- */
+
+static void report(FILE* out, const char* csvPath) {
+    fprintf(out, "%-16s %8s %10s %10s %10s\n", "marker", "count", "min", "avg", "max");
+    for(int id = 0; id < 256; id++) {
+        marker_t* m = &markers[id];
+        if(m->count == 0) continue;
+        fprintf(out, "%-16s %8llu %10llu %10llu %10llu\n", markerName(id),
+                (unsigned long long)m->count, (unsigned long long)m->min,
+                (unsigned long long)(m->total / m->count), (unsigned long long)m->max);
+    }
+    fprintf(out, "%llu apdus in %llu cycles (%.3f ms)\n", (unsigned long long)apdus,
+            (unsigned long long)avr->cycle, avr->cycle * 1000.0 / F_CPU);
+
+    if(csvPath) {
+        FILE* csv = fopen(csvPath, "w");
+        if(!csv) {
+            perror(csvPath);
+            exit(1);
+        }
+        fprintf(csv, "marker,id,count,min,avg,max\n");
+        for(int id = 0; id < 256; id++) {
+            marker_t* m = &markers[id];
+            if(m->count == 0) continue;
+            fprintf(csv, "%s,0x%02x,%llu,%llu,%llu,%llu\n", markerName(id), id,
+                    (unsigned long long)m->count, (unsigned long long)m->min,
+                    (unsigned long long)(m->total / m->count), (unsigned long long)m->max);
+        }
+        fprintf(csv, "total,,%llu,%llu,,\n", (unsigned long long)apdus, (unsigned long long)avr->cycle);
+        fclose(csv);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    const char* csvPath = NULL;
+    double maxSeconds = 30;
+    int arg = 1;
+    for(; arg < argc && argv[arg][0] == '-'; arg++) {
+        if(0 == strcmp(argv[arg], "-c") && arg + 1 < argc) {
+            csvPath = argv[++arg];
+        } else if(0 == strcmp(argv[arg], "-l") && arg + 1 < argc) {
+            maxSeconds = atof(argv[++arg]);
+        } else if(0 == strcmp(argv[arg], "-r") && arg + 1 < argc) {
+            rfCycles = (uint64_t)(atof(argv[++arg]) * (F_CPU / 1000000));
+        } else {
+            break;
+        }
+    }
+    if(argc - arg != 2) {
+        fprintf(stderr, "usage: %s [-c results.csv] [-l max_seconds] [-r rf_us] firmware.elf scenario.txt\n", argv[0]);
+        return 1;
+    }
+
+    elf_firmware_t firmware;
+    memset(&firmware, 0, sizeof(firmware));
+    if(elf_read_firmware(argv[arg], &firmware) != 0) {
+        fprintf(stderr, "cannot load %s\n", argv[arg]);
+        return 1;
+    }
+    loadScenario(argv[arg + 1]);
+
+    avr = avr_make_mcu_by_name("atmega2560");
+    if(!avr) {
+        fprintf(stderr, "simavr has no atmega2560 core\n");
+        return 1;
+    }
+    avr_init(avr);
+    firmware.frequency = F_CPU;
+    avr_load_firmware(avr, &firmware);
+
+    avr_register_io_write(avr, GPIOR0_ADDR, markerBegin, NULL);
+    avr_register_io_write(avr, GPIOR1_ADDR, markerEnd, NULL);
+    avr_register_io_write(avr, GPIOR2_ADDR, markerPause, NULL);
+
+    spiIn = avr_io_getirq(avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_INPUT);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_OUTPUT), spiOutput, NULL);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(PN532_SS_PORT), PN532_SS_PIN), spiSelect, NULL);
+
+    uint32_t flags = 0;
+    avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+    flags &= ~AVR_UART_FLAG_STDIO;
+    avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+    uartIn = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT), uartOutput, NULL);
+
+    advanceScript();
+
+    uint64_t limit = (uint64_t)(maxSeconds * F_CPU);
+    int state = cpu_Running;
+    while(!finished && avr->cycle < limit && state != cpu_Done && state != cpu_Crashed) {
+        state = avr_run(avr);
+    }
+
+    report(stdout, csvPath);
+    if(!finished) {
+        fprintf(stderr, "scenario stopped at step %d of %d\n", stepIdx + 1, stepCount);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,107 @@
+/**************************************************************************/
+/*!
+ @file     SerialProtocol.h
+ @license  BSD
+
+ Message framing of the NfcMega2 serial protocol, shared by the bridge
+ daemon and the pty test rig.
+
+ Boards send "<command>:<value>;" (println adds CR LF after it), the host
+ answers the same way or with newline terminated rec:/pur: lines. A
+ MessageBuffer collects what read() returns and hands out messages that
+ point straight into its storage, nothing is copied per message.
+ */
+/**************************************************************************/
+
+#ifndef __SERIAL_PROTOCOL_H__
+#define __SERIAL_PROTOCOL_H__
+
+#include <stddef.h>
+#include <string.h>
+
+#define MESSAGE_BUFFER_SIZE 4096
+
+struct Message {
+    const char* command;    // up to and including the first ':'
+    size_t commandLength;
+    const char* value;      // after the ':', terminator excluded
+    size_t valueLength;
+
+    bool is(const char* name) const {
+        size_t n = strlen(name);
+        return commandLength == n && 0 == memcmp(command, name, n);
+    }
+
+    bool valueIs(const char* text) const {
+        size_t n = strlen(text);
+        return valueLength == n && 0 == memcmp(value, text, n);
+    }
+};
+
+class MessageBuffer {
+public:
+    MessageBuffer() : start(0), length(0) { }
+
+    // free space for the next read()
+    char* tail() {
+        compact();
+        return data + length;
+    }
+
+    size_t space() const {
+        return MESSAGE_BUFFER_SIZE - length;
+    }
+
+    void produced(size_t n) {
+        length += n;
+    }
+
+    /*
+     * Next complete message, its pointers stay valid until the next tail().
+     * @return false when no complete message is buffered
+     */
+    bool next(Message* message) {
+        while(start < length && (data[start] == '\r' || data[start] == '\n')) {
+            start++;
+        }
+        size_t end = start;
+        while(end < length && data[end] != ';' && data[end] != '\n') {
+            end++;
+        }
+        if(end == length) {
+            if(start == 0 && length == MESSAGE_BUFFER_SIZE) {
+                length = 0; // no terminator in a full buffer, drop the garbage
+            }
+            return false;
+        }
+        const char* colon = (const char*)memchr(data + start, ':', end - start);
+        message->command = data + start;
+        if(colon != 0) {
+            message->commandLength = colon + 1 - message->command;
+            message->value = colon + 1;
+            message->valueLength = data + end - message->value;
+        } else {
+            message->commandLength = end - start;
+            message->value = data + end;
+            message->valueLength = 0;
+        }
+        start = end + 1;
+        return true;
+    }
+
+private:
+    char data[MESSAGE_BUFFER_SIZE];
+    size_t start;   // first unparsed byte
+    size_t length;
+
+    // moves the unparsed tail to the front, usually a few bytes of a partial message
+    void compact() {
+        if(start > 0) {
+            memmove(data, data + start, length - start);
+            length -= start;
+            start = 0;
+        }
+    }
+};
+
+#endif
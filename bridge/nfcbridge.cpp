@@ -0,0 +1,440 @@
+/**************************************************************************/
+/*!
+ @file     nfcbridge.cpp
+ @license  BSD
+
+ Reference host for many NfcMega2 boards on one Linux box.
+
+ Every board is a serial device driven with non-blocking I/O from a single
+ epoll loop. The daemon answers the board requests itself:
+
+   connection:req;   -> connection:ok;
+   get_time:req;     -> set_time:<seconds><ms>;
+   set_data:<credit>; -> set_data:ok; (err when the credit is no amount)
+
+ and forwards logins, transactions and logs upstream as JSON lines on
+ stdout, in batches. Lines on stdin of the form "<board> <text>" are sent
+ to that board followed by a newline, e.g. "3 rec:00.50", or "3 get_diag:"
+ for the timeout and session counters of board 3. Boards are provisioned
+ the same way, e.g. "3 set_config:id=00001234,name=Macchina 3", and
+ "3 clear_ndef:" drops the NDEF file a phone wrote to board 3.
+
+ Per board latency (board request read -> answer written) is printed on
+ SIGUSR1, every -m seconds and at exit.
+
+ usage: nfcbridge [-b batch_events] [-f flush_ms] [-m metrics_s] device...
+ */
+/**************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "SerialProtocol.h"
+
+#define OUTPUT_BUFFER_SIZE 1024
+#define BATCH_BUFFER_SIZE 65536
+#define LATENCY_BUCKETS 32      // log2 buckets of microseconds
+#define MAX_EVENTS 64
+#define STDIN_INDEX -1
+
+static uint64_t nowMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct LatencyStats {
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+    uint64_t buckets[LATENCY_BUCKETS];
+
+    void add(uint64_t micros) {
+        int bucket = 0;
+        while(bucket < LATENCY_BUCKETS - 1 && (1ULL << (bucket + 1)) <= micros) {
+            bucket++;
+        }
+        buckets[bucket]++;
+        count++;
+        total += micros;
+        if(micros > max) {
+            max = micros;
+        }
+    }
+
+    // upper bound of the bucket holding the given fraction of the samples, never above max
+    uint64_t percentile(double fraction) const {
+        uint64_t wanted = (uint64_t)(count * fraction);
+        uint64_t seen = 0;
+        for(int i = 0; i < LATENCY_BUCKETS; i++) {
+            seen += buckets[i];
+            if(seen > wanted) {
+                uint64_t bound = 1ULL << (i + 1);
+                return bound < max ? bound : max;
+            }
+        }
+        return max;
+    }
+};
+
+struct Board {
+    std::string path;
+    int fd;
+    MessageBuffer input;
+    char output[OUTPUT_BUFFER_SIZE];
+    size_t outputLength;
+    uint64_t pendingSince;  // read time of the oldest unanswered request, 0 = none
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    uint64_t messages;
+    LatencyStats latency;
+};
+
+static std::vector<Board*> boards;
+static int epollFd;
+static volatile sig_atomic_t dumpMetrics;
+static volatile sig_atomic_t running = 1;
+
+static char batch[BATCH_BUFFER_SIZE];
+static size_t batchLength;
+static int batchEvents;
+static uint64_t batchSince;
+static int batchMax = 32;
+static uint64_t flushMicros = 100000;
+
+static void onSignal(int sig) {
+    if(sig == SIGUSR1) {
+        dumpMetrics = 1;
+    } else {
+        running = 0;
+    }
+}
+
+static int openSerial(const char* path) {
+    int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if(fd < 0) {
+        perror(path);
+        return -1;
+    }
+    struct termios tio;
+    if(tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        cfsetispeed(&tio, B115200);
+        cfsetospeed(&tio, B115200);
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+    return fd;
+}
+
+static void watch(int fd, int index, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = (uint64_t)(int64_t)index;
+    if(epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+/* ---- upstream ---- */
+
+static void flushBatch() {
+    size_t done = 0;
+    while(done < batchLength) {
+        ssize_t n = write(STDOUT_FILENO, batch + done, batchLength - done);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    batchLength = 0;
+    batchEvents = 0;
+}
+
+static void appendBatch(const char* text, size_t length) {
+    if(batchLength + length > BATCH_BUFFER_SIZE) {
+        flushBatch();
+    }
+    memcpy(batch + batchLength, text, length);
+    batchLength += length;
+}
+
+static void appendEscaped(const char* text, size_t length) {
+    for(size_t i = 0; i < length; i++) {
+        char c = text[i];
+        if(c == '"' || c == '\\') {
+            appendBatch("\\", 1);
+        } else if((unsigned char)c < 0x20) {
+            continue;
+        }
+        appendBatch(&c, 1);
+    }
+}
+
+static void upstreamEvent(int board, const char* type, const char* value, size_t valueLength) {
+    char head[96];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int n = snprintf(head, sizeof(head), "{\"board\":%d,\"time\":%lld%03ld,\"type\":\"%s\",\"value\":\"",
+                     board, (long long)ts.tv_sec, ts.tv_nsec / 1000000, type);
+    appendBatch(head, n);
+    appendEscaped(value, valueLength);
+    appendBatch("\"}\n", 3);
+    if(batchEvents++ == 0) {
+        batchSince = nowMicros();
+    }
+    if(batchEvents >= batchMax) {
+        flushBatch();
+    }
+}
+
+/* ---- boards ---- */
+
+static void flushBoard(int index) {
+    Board* b = boards[index];
+    while(b->outputLength > 0) {
+        ssize_t n = write(b->fd, b->output, b->outputLength);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN) {
+                watch(b->fd, index, EPOLLIN | EPOLLOUT);
+                return;
+            }
+            b->outputLength = 0;
+            break;
+        }
+        memmove(b->output, b->output + n, b->outputLength - n);
+        b->outputLength -= n;
+        b->bytesOut += n;
+    }
+    if(b->pendingSince != 0) {
+        b->latency.add(nowMicros() - b->pendingSince);
+        b->pendingSince = 0;
+    }
+    watch(b->fd, index, EPOLLIN);
+}
+
+static void sendBoard(Board* b, const char* text, size_t length) {
+    if(b->outputLength + length > OUTPUT_BUFFER_SIZE) {
+        return; // board is not reading, drop rather than block everyone
+    }
+    memcpy(b->output + b->outputLength, text, length);
+    b->outputLength += length;
+}
+
+// credit the board read from the phone: digits, at most one '.' followed by up to two digits
+static bool isAmount(const char* value, size_t length) {
+    size_t digits = 0;
+    size_t decimals = 0;
+    bool point = false;
+    for(size_t i = 0; i < length; i++) {
+        if(value[i] == '.' && !point) {
+            point = true;
+        } else if(value[i] >= '0' && value[i] <= '9') {
+            if(point) {
+                decimals++;
+            } else {
+                digits++;
+            }
+        } else {
+            return false;
+        }
+    }
+    return digits > 0 && digits <= 5 && decimals <= 2;
+}
+
+static void handleMessage(int index, const Message& m, uint64_t readAt) {
+    Board* b = boards[index];
+    b->messages++;
+    bool answered = true;
+    if(m.is("connection:") && m.valueIs("req")) {
+        sendBoard(b, "connection:ok;", 14);
+        upstreamEvent(index, "online", m.value, 0);
+    } else if(m.is("get_time:") && m.valueIs("req")) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        char reply[40];
+        int n = snprintf(reply, sizeof(reply), "set_time:%lld%03ld;", (long long)ts.tv_sec, ts.tv_nsec / 1000000);
+        sendBoard(b, reply, n);
+    } else if(m.is("set_data:")) {
+        // the board parsed the credit out of the phone's login, a garbled one is refused
+        if(isAmount(m.value, m.valueLength)) {
+            sendBoard(b, "set_data:ok;", 12);
+            upstreamEvent(index, "login", m.value, m.valueLength);
+        } else {
+            sendBoard(b, "set_data:err;", 13);
+            upstreamEvent(index, "login_refused", m.value, m.valueLength);
+        }
+    } else {
+        answered = false;
+        if(m.is("log:")) {
+            upstreamEvent(index, "log", m.value, m.valueLength);
+        } else if(m.is("diag:")) {
+            upstreamEvent(index, "diag", m.value, m.valueLength);
+        } else if(m.is("config:") || m.is("set_config:") || m.is("clear_ndef:")) {
+            upstreamEvent(index, "config", m.value, m.valueLength);
+        } else {
+            upstreamEvent(index, "unknown", m.command, m.commandLength + m.valueLength);
+        }
+    }
+    if(answered && b->pendingSince == 0) {
+        b->pendingSince = readAt;
+    }
+}
+
+static void readBoard(int index) {
+    Board* b = boards[index];
+    for(;;) {
+        ssize_t n = read(b->fd, b->input.tail(), b->input.space());
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            if(n == 0 || errno != EAGAIN) {
+                fprintf(stderr, "%s: closed\n", b->path.c_str());
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, b->fd, 0);
+            }
+            break;
+        }
+        uint64_t readAt = nowMicros();
+        b->bytesIn += n;
+        b->input.produced(n);
+        Message m;
+        while(b->input.next(&m)) {
+            handleMessage(index, m, readAt);
+        }
+    }
+    if(b->outputLength > 0) {
+        flushBoard(index);
+    }
+}
+
+// "<board> <text>" lines from stdin
+static void readControl() {
+    static MessageBuffer control;
+    ssize_t n = read(STDIN_FILENO, control.tail(), control.space());
+    if(n <= 0) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, STDIN_FILENO, 0);
+        return;
+    }
+    control.produced(n);
+    Message m;
+    while(control.next(&m)) {
+        // no ':' in "<board> <text>" before the command, so the whole line is in command+value
+        const char* line = m.command;
+        size_t length = m.commandLength + m.valueLength;
+        char* end;
+        long index = strtol(line, &end, 10);
+        if(end == line || index < 0 || index >= (long)boards.size()) {
+            fprintf(stderr, "control: no board in '%.*s'\n", (int)length, line);
+            continue;
+        }
+        while(*end == ' ') end++;
+        Board* b = boards[index];
+        sendBoard(b, end, line + length - end);
+        sendBoard(b, "\n", 1);
+        flushBoard(index);
+    }
+}
+
+static void printMetrics() {
+    fprintf(stderr, "%-24s %8s %8s %8s %10s %10s %10s\n", "board", "msgs", "in", "out", "avg_us", "p99_us", "max_us");
+    for(size_t i = 0; i < boards.size(); i++) {
+        Board* b = boards[i];
+        const LatencyStats& l = b->latency;
+        fprintf(stderr, "%-24s %8llu %8llu %8llu %10llu %10llu %10llu\n", b->path.c_str(),
+                (unsigned long long)b->messages, (unsigned long long)b->bytesIn, (unsigned long long)b->bytesOut,
+                (unsigned long long)(l.count ? l.total / l.count : 0), (unsigned long long)l.percentile(0.99),
+                (unsigned long long)l.max);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int metricsSeconds = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "b:f:m:")) != -1) {
+        switch(opt) {
+            case 'b': batchMax = atoi(optarg); break;
+            case 'f': flushMicros = (uint64_t)atoi(optarg) * 1000; break;
+            case 'm': metricsSeconds = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-b batch_events] [-f flush_ms] [-m metrics_s] device...\n", argv[0]);
+                return 1;
+        }
+    }
+    if(optind == argc) {
+        fprintf(stderr, "usage: %s [-b batch_events] [-f flush_ms] [-m metrics_s] device...\n", argv[0]);
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onSignal;
+    sigaction(SIGUSR1, &sa, 0);
+    sigaction(SIGINT, &sa, 0);
+    sigaction(SIGTERM, &sa, 0);
+    signal(SIGPIPE, SIG_IGN);
+
+    epollFd = epoll_create1(0);
+    for(int i = optind; i < argc; i++) {
+        int fd = openSerial(argv[i]);
+        if(fd < 0) {
+            return 1;
+        }
+        Board* b = new Board();
+        b->path = argv[i];
+        b->fd = fd;
+        boards.push_back(b);
+        watch(fd, boards.size() - 1, EPOLLIN);
+    }
+    watch(STDIN_FILENO, STDIN_INDEX, EPOLLIN);
+
+    uint64_t nextMetrics = nowMicros() + (uint64_t)metricsSeconds * 1000000;
+    struct epoll_event events[MAX_EVENTS];
+    while(running) {
+        int timeout = batchEvents > 0 ? (int)(flushMicros / 1000) : 1000;
+        int n = epoll_wait(epollFd, events, MAX_EVENTS, timeout);
+        for(int i = 0; i < n; i++) {
+            int index = (int)(int64_t)events[i].data.u64;
+            if(index == STDIN_INDEX) {
+                readControl();
+                continue;
+            }
+            if(events[i].events & EPOLLOUT) {
+                flushBoard(index);
+            }
+            if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                readBoard(index);
+            }
+        }
+        uint64_t now = nowMicros();
+        if(batchEvents > 0 && now - batchSince >= flushMicros) {
+            flushBatch();
+        }
+        if(dumpMetrics || (metricsSeconds > 0 && now >= nextMetrics)) {
+            printMetrics();
+            dumpMetrics = 0;
+            nextMetrics = now + (uint64_t)metricsSeconds * 1000000;
+        }
+    }
+    flushBatch();
+    printMetrics();
+    return 0;
+}
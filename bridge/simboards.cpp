@@ -0,0 +1,243 @@
+/**************************************************************************/
+/*!
+ @file     simboards.cpp
+ @license  BSD
+
+ pty test rig for nfcbridge: simulates many NfcMega2 boards and measures
+ how fast one bridge serves them.
+
+ Every board gets a pty. The rig starts the bridge command with all pty
+ slave paths appended, then each board plays sessions of the serial
+ protocol as the firmware does (time sync, app connection, login,
+ transaction log), waiting for the answer to each request. Round trip
+ times of all requests are reported at the end.
+
+ usage: simboards [-n boards] [-s sessions] [-o upstream_file] -- bridge [args...]
+ e.g.   simboards -n 200 -s 50 -- ./nfcbridge -b 64
+ */
+/**************************************************************************/
+
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "SerialProtocol.h"
+
+#define MAX_EVENTS 64
+#define STALL_TIMEOUT_MS 10000
+
+struct Step {
+    const char* request;
+    const char* answer;     // command of the expected answer, 0 = none
+};
+
+// one session, as the firmware talks to the host
+static const Step session[] = {
+    { "log:target inizializzato;\r\n", 0 },
+    { "get_time:req;\r\n", "set_time:" },
+    { "connection:req;\r\n", "connection:" },
+    { "log:u1,10.00;\r\n", 0 },
+    { "set_data:10.00;\r\n", "set_data:" },
+    { "log: recharge 00.50,1445000000000 10000001;\r\n", 0 },
+    { "log:in release;\r\n", 0 },
+};
+static const int sessionSteps = sizeof(session) / sizeof(session[0]);
+
+struct SimBoard {
+    int master;
+    int slave;          // kept open so the pty stays up until the bridge opens it
+    std::string path;
+    MessageBuffer input;
+    int step;
+    int sessionsLeft;
+    uint64_t sentAt;
+};
+
+static uint64_t nowMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static std::vector<SimBoard*> boards;
+static std::vector<uint32_t> roundTrips;
+static uint64_t requests;
+static int boardsDone;
+
+static void writeAll(int fd, const char* text) {
+    size_t length = strlen(text);
+    while(length > 0) {
+        ssize_t n = write(fd, text, length);
+        if(n < 0) {
+            if(errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            return;
+        }
+        text += n;
+        length -= n;
+    }
+}
+
+// sends requests until one needs an answer or the board is done
+static void advance(SimBoard* b) {
+    while(b->sessionsLeft > 0) {
+        const Step& s = session[b->step];
+        b->sentAt = nowMicros();
+        writeAll(b->master, s.request);
+        requests++;
+        if(s.answer != 0) {
+            return;
+        }
+        if(++b->step == sessionSteps) {
+            b->step = 0;
+            if(--b->sessionsLeft == 0) {
+                boardsDone++;
+            }
+        }
+    }
+}
+
+static void readBoard(SimBoard* b) {
+    ssize_t n = read(b->master, b->input.tail(), b->input.space());
+    if(n <= 0) {
+        return;
+    }
+    b->input.produced(n);
+    Message m;
+    while(b->input.next(&m)) {
+        if(b->sessionsLeft == 0 || session[b->step].answer == 0 || !m.is(session[b->step].answer)) {
+            continue;
+        }
+        roundTrips.push_back((uint32_t)(nowMicros() - b->sentAt));
+        if(++b->step == sessionSteps) {
+            b->step = 0;
+            if(--b->sessionsLeft == 0) {
+                boardsDone++;
+                continue;
+            }
+        }
+        advance(b);
+    }
+}
+
+static SimBoard* openBoard(int sessions) {
+    SimBoard* b = new SimBoard();
+    b->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if(b->master < 0 || grantpt(b->master) < 0 || unlockpt(b->master) < 0) {
+        perror("posix_openpt");
+        exit(1);
+    }
+    b->path = ptsname(b->master);
+    // raw before the bridge opens it, or the line discipline echoes our requests back
+    b->slave = open(b->path.c_str(), O_RDWR | O_NOCTTY);
+    struct termios tio;
+    tcgetattr(b->slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(b->slave, TCSANOW, &tio);
+    b->step = 0;
+    b->sessionsLeft = sessions;
+    return b;
+}
+
+int main(int argc, char* argv[]) {
+    int boardCount = 10;
+    int sessions = 10;
+    const char* upstream = "/dev/null";
+    int opt;
+    while((opt = getopt(argc, argv, "n:s:o:")) != -1) {
+        switch(opt) {
+            case 'n': boardCount = atoi(optarg); break;
+            case 's': sessions = atoi(optarg); break;
+            case 'o': upstream = optarg; break;
+            default: optind = argc; break;
+        }
+    }
+    if(optind >= argc || boardCount <= 0 || sessions <= 0) {
+        fprintf(stderr, "usage: %s [-n boards] [-s sessions] [-o upstream_file] -- bridge [args...]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<char*> bridgeArgs(argv + optind, argv + argc);
+    for(int i = 0; i < boardCount; i++) {
+        boards.push_back(openBoard(sessions));
+        bridgeArgs.push_back((char*)boards.back()->path.c_str());
+    }
+    bridgeArgs.push_back(0);
+
+    int pipeFds[2];
+    if(pipe(pipeFds) < 0) {
+        perror("pipe");
+        return 1;
+    }
+    pid_t bridge = fork();
+    if(bridge == 0) {
+        // stdin stays open and empty, upstream events go to the file
+        dup2(pipeFds[0], STDIN_FILENO);
+        int out = open(upstream, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(out, STDOUT_FILENO);
+        execvp(bridgeArgs[0], bridgeArgs.data());
+        perror(bridgeArgs[0]);
+        _exit(127);
+    }
+    close(pipeFds[0]);
+
+    int epollFd = epoll_create1(0);
+    for(size_t i = 0; i < boards.size(); i++) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = boards[i];
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, boards[i]->master, &ev);
+    }
+
+    uint64_t start = nowMicros();
+    for(size_t i = 0; i < boards.size(); i++) {
+        advance(boards[i]);
+    }
+    struct epoll_event events[MAX_EVENTS];
+    while(boardsDone < boardCount) {
+        int n = epoll_wait(epollFd, events, MAX_EVENTS, STALL_TIMEOUT_MS);
+        if(n == 0) {
+            fprintf(stderr, "stalled: %d of %d boards done\n", boardsDone, boardCount);
+            break;
+        }
+        for(int i = 0; i < n; i++) {
+            readBoard((SimBoard*)events[i].data.ptr);
+        }
+    }
+    uint64_t elapsed = nowMicros() - start;
+
+    kill(bridge, SIGTERM);
+    waitpid(bridge, 0, 0);
+    close(pipeFds[1]);
+
+    std::sort(roundTrips.begin(), roundTrips.end());
+    size_t count = roundTrips.size();
+    uint64_t total = 0;
+    for(size_t i = 0; i < count; i++) {
+        total += roundTrips[i];
+    }
+    printf("%d boards, %llu requests, %zu answered in %.3f s (%.0f requests/s)\n", boardCount,
+           (unsigned long long)requests, count, elapsed / 1e6, requests * 1e6 / (elapsed ? elapsed : 1));
+    if(count > 0) {
+        printf("round trip us: min %u avg %llu p50 %u p99 %u max %u\n", roundTrips[0],
+               (unsigned long long)(total / count), roundTrips[count / 2], roundTrips[count * 99 / 100],
+               roundTrips[count - 1]);
+    }
+    return boardsDone == boardCount ? 0 : 1;
+}